@@ -5,15 +5,45 @@
 // Licenced for any use whatsoever.
 // Please attribute.
 
-// Compile with eg. "g++ -Wall -O2 closest.cpp -o closest"
-// Usage: closest [-r] [-p] [-t threshold] [-test] npoints
+// Compile with eg. "g++ -Wall -O2 -pthread closest.cpp -o closest"
+// (add -DINSTRUMENT for recursion and strip statistics as JSON on stderr at exit)
+// or for SIMD "g++ -Wall -O2 -march=native -ffp-contract=off -pthread closest.cpp -o closest"
+// (without -ffp-contract=off, -test can fail from FMA rounding differences).
+// Usage: closest [-r] [-p] [-t threshold] [-j threads] [-g grain] [-soa] [-grid]
+//                [-updates N] [-k K] [-nn] [-read file] [-write file] [-ooc MB]
+//                [-dim D] [-coord type] [-bench] [-tune file] [-batch N]
+//                [-test] npoints
 //  -r: randomize at startup
 //  -p: print point set
-//  -t: threshold size for switching to brute force, default 0
+//  -t: threshold size for switching to brute force, default 0, or 32 with -soa,
+//   unless read from a -tune file
+//  -j: number of threads, default 1
+//  -g: smallest problem to split between threads, default 10000
+//  -soa: use contiguous coordinate arrays and SIMD rather than index arrays
+//  -grid: use the expected linear time grid algorithm, with no sorting
+//   (so, without -test, no check for equal points either)
+//  -updates: keep the points in a dynamic structure and move one N times,
+//   finding the closest pair (distance and point indices) after each
+//  -k: print the K closest pairs (distance and point indices), using a kd-tree
+//  -nn: find every point's nearest neighbour, using a kd-tree
+//  -read: use the points in a binary point file (see writepoints), not npoints random ones
+//  -write: save the points to a binary point file
+//  -ooc: out of core, using about MB megabytes of memory for the points
+//  -dim: use the generic solver on random points in D dimensions, 2 to 4,
+//   printing the distance and point indices
+//  -coord: use the generic solver with float, double (the default), int32 or int64 coordinates
+//  -bench: tune the threshold (unless -t is given), then time sorting,
+//   recursion and strips on every distribution for up to npoints points
+//  -tune: with -bench, store the tuned thresholds in file; otherwise use
+//   the threshold stored there (unless -t is given)
+//  -batch: split the points into sets of 2 to N points and find the
+//   closest pair of each, printing the smallest distance and the time
 //  -test: loop checking various randomly generated datasets against brute force
+//   (with -read, check the file once)
 //  npoints: the number of point to generate.
 
 #include <vector>
+#include <array>
 #include <iostream>
 #include <algorithm>
 #include <limits>
@@ -21,7 +51,24 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <stdint.h>
 #include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <random>
+#include <thread>
 
 using namespace std;
 
@@ -41,8 +88,16 @@ struct Point
   double y;
 };
 
+// The points, generated or mapped from a file, indexed like a vector.
 // This should be wrapped inside a proper class of course.
-vector<Point> points;
+struct PointArray
+{
+  const Point *data;
+  size_t count;
+  const Point &operator[](size_t i) const { return data[i]; }
+  size_t size() const { return count; }
+};
+PointArray points;
 
 // Pointer to member template handy for dealing with the two orientations
 template<double Point::*xf, double Point::*yf>
@@ -77,20 +132,382 @@ double closest0(const int *px, int size)
   return dist;
 }
 
+// A small work-stealing thread pool, for fork-join parallelism.
+// Each thread has its own deque of tasks: it pushes and pops its own
+// at the back, and when that is empty steals the oldest, and so
+// biggest, task from the front of someone else's. Thread 0 is the
+// thread that made the pool.
+class Pool
+{
+public:
+  typedef function<void()> Task;
+  Pool(int nthreads);
+  ~Pool();
+  int size() const { return nthreads; }
+  // Run the task, maybe on another thread, decrementing *pending
+  // when it is done.
+  void spawn(const Task &task, atomic<int> *pending);
+  // Run tasks, our own or stolen, until *pending is zero.
+  void wait(atomic<int> *pending);
+  // Run f(0)...f(n-1) in parallel and wait for them all.
+  template<typename F> void parallelfor(int n, const F &f) {
+    atomic<int> pending(n-1);
+    for (int i = 1; i < n; i++) spawn([&f,i]{ f(i); }, &pending);
+    f(0);
+    wait(&pending);
+  }
+private:
+  struct Item { Task task; atomic<int> *pending; };
+  struct Queue { mutex m; deque<Item> items; };
+  bool runone();
+  void worker(int index);
+  int nthreads;
+  Queue *queues;
+  vector<thread> threads;
+  atomic<int> queued;
+  atomic<bool> done;
+  mutex idlemutex;
+  condition_variable idle;
+  static thread_local int self;
+};
+
+thread_local int Pool::self = 0;
+
+Pool::Pool(int nthreads_)
+  : nthreads(nthreads_), queues(new Queue[nthreads_]), queued(0), done(false)
+{
+  for (int i = 1; i < nthreads; i++) threads.push_back(thread(&Pool::worker, this, i));
+}
+
+Pool::~Pool()
+{
+  done = true;
+  idle.notify_all();
+  for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+  delete [] queues;
+}
+
+void Pool::spawn(const Task &task, atomic<int> *pending)
+{
+  Queue &q = queues[self];
+  {
+    lock_guard<mutex> lock(q.m);
+    q.items.push_back(Item{task, pending});
+  }
+  queued++;
+  idle.notify_one();
+}
+
+bool Pool::runone()
+{
+  Item item;
+  bool found = false;
+  for (int i = 0; i < nthreads && !found; i++) {
+    Queue &q = queues[(self+i)%nthreads];
+    lock_guard<mutex> lock(q.m);
+    if (q.items.empty()) continue;
+    if (i == 0) {
+      item = q.items.back();
+      q.items.pop_back();
+    } else {
+      item = q.items.front();
+      q.items.pop_front();
+    }
+    found = true;
+  }
+  if (!found) return false;
+  queued--;
+  item.task();
+  item.pending->fetch_sub(1, memory_order_release);
+  return true;
+}
+
+void Pool::wait(atomic<int> *pending)
+{
+  while (pending->load(memory_order_acquire) > 0) {
+    if (!runone()) this_thread::yield();
+  }
+}
+
+void Pool::worker(int index)
+{
+  self = index;
+  while (!done) {
+    if (runone()) continue;
+    // Notifications can get lost, so don't sleep for long
+    unique_lock<mutex> lock(idlemutex);
+    idle.wait_for(lock, chrono::milliseconds(1), [this]{ return queued > 0 || done; });
+  }
+}
+
+// With -j, the pool, else NULL and everything is sequential.
+Pool *pool = NULL;
+
+// Problems at least this big have their halves solved in parallel.
+int grain = 10000;
+
+// Problems at least this big also partition and scan the strip in
+// parallel, in this many pieces per thread.
+const int parallelscan = 1 << 17;
+const int chunksperthread = 4;
+
 // Problems below this size, use brute force, configurable.
 int thresh = 0;
 
-// Maximum number of time round inner loop of edge strip test.
-int maxloops = 0;
+// With -bench, the time spent finding and scanning strips, summed over
+// threads, else NULL so closest() doesn't read the clock.
+atomic<int64_t> *stripns = NULL;
+
+static inline int64_t nanos()
+{
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Instrumentation of closest() and closestsoa(), compiled in with
+// -DINSTRUMENT: each thread counts into its own Stats, and the totals
+// are written to stderr as JSON at exit. Without it, INSTR() drops its
+// argument and nothing is counted or timed.
+#if defined INSTRUMENT
+#define INSTR(...) __VA_ARGS__
+
+enum Phase { PHASE_SPLIT, PHASE_BASE, PHASE_STRIP, PHASE_SCAN, NPHASES };
+const char *phasenames[NPHASES] = { "split", "base", "strip", "scan" };
+
+// Strip sizes are counted in powers of 2: bucket b is [2^(b-1),2^b)
+const int STATS_BUCKETS = 33;
+
+struct Stats
+{
+  int depth; // Current recursion depth on this thread
+  int maxdepth;
+  int64_t calls;
+  int64_t basecalls;
+  int64_t strips;
+  int64_t strippoints;
+  int64_t comparisons;
+  int maxcomparisons; // Most for one point in a strip
+  int64_t stripsizes[STATS_BUCKETS];
+  int64_t ns[NPHASES];
+};
+
+mutex statsmutex;
+vector<Stats *> allstats;
+
+Stats &stats()
+{
+  static thread_local Stats *mine = NULL;
+  if (mine == NULL) {
+    mine = new Stats();
+    lock_guard<mutex> lock(statsmutex);
+    allstats.push_back(mine);
+  }
+  return *mine;
+}
+
+// Adds the time from construction to stop(), or destruction, to a phase
+class PhaseTimer
+{
+public:
+  PhaseTimer(Phase phase_) : phase(phase_), start(nanos()) {}
+  ~PhaseTimer() { stop(); }
+  void stop() {
+    if (start < 0) return;
+    stats().ns[phase] += nanos()-start;
+    start = -1;
+  }
+private:
+  Phase phase;
+  int64_t start;
+};
+
+// One level of recursion
+class Level
+{
+public:
+  Level() {
+    Stats &s = stats();
+    s.depth++;
+    s.maxdepth = max(s.maxdepth, s.depth);
+    s.calls++;
+  }
+  ~Level() { stats().depth--; }
+};
+
+// A task runs at the depth it was spawned from, whichever thread
+// runs it.
+class TaskDepth
+{
+public:
+  TaskDepth(int depth) : saved(stats().depth) { stats().depth = depth; }
+  ~TaskDepth() { stats().depth = saved; }
+private:
+  int saved;
+};
+
+static void countstrip(int npoints)
+{
+  Stats &s = stats();
+  s.strips++;
+  s.strippoints += npoints;
+  s.stripsizes[npoints == 0 ? 0 : 32-__builtin_clz(npoints)]++;
+}
+
+static void countscan(int64_t comparisons, int most)
+{
+  Stats &s = stats();
+  s.comparisons += comparisons;
+  s.maxcomparisons = max(s.maxcomparisons, most);
+}
+
+struct StatsReport
+{
+  ~StatsReport() {
+    Stats total = Stats();
+    lock_guard<mutex> lock(statsmutex);
+    for (Stats *t : allstats) {
+      total.maxdepth = max(total.maxdepth, t->maxdepth);
+      total.calls += t->calls;
+      total.basecalls += t->basecalls;
+      total.strips += t->strips;
+      total.strippoints += t->strippoints;
+      total.comparisons += t->comparisons;
+      total.maxcomparisons = max(total.maxcomparisons, t->maxcomparisons);
+      for (int i = 0; i < STATS_BUCKETS; i++) total.stripsizes[i] += t->stripsizes[i];
+      for (int i = 0; i < NPHASES; i++) total.ns[i] += t->ns[i];
+    }
+    fprintf(stderr, "{\"threads\": %zu, \"calls\": %ld, \"maxdepth\": %d, \"basecalls\": %ld,\n",
+	    allstats.size(), total.calls, total.maxdepth, total.basecalls);
+    fprintf(stderr, " \"strips\": %ld, \"strippoints\": %ld, \"comparisons\": %ld,"
+	    " \"comparisonsperpoint\": %g, \"maxcomparisons\": %d,\n",
+	    total.strips, total.strippoints, total.comparisons,
+	    total.strippoints ? (double)total.comparisons/total.strippoints : 0.0,
+	    total.maxcomparisons);
+    // Each strip size bucket as [smallest size, count]
+    fprintf(stderr, " \"stripsizes\": [");
+    const char *sep = "";
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+      if (total.stripsizes[i] == 0) continue;
+      fprintf(stderr, "%s[%ld, %ld]", sep, i == 0 ? 0L : 1L << (i-1), total.stripsizes[i]);
+      sep = ", ";
+    }
+    fprintf(stderr, "],\n \"ns\": {");
+    for (int i = 0; i < NPHASES; i++) {
+      fprintf(stderr, "%s\"%s\": %ld", i ? ", " : "", phasenames[i], total.ns[i]);
+    }
+    fprintf(stderr, "}}\n");
+  }
+} statsreport;
+#else
+#define INSTR(...)
+#endif
+
+static inline bool parallel(int size, int cutoff)
+{
+  return pool != NULL && size >= cutoff;
+}
+
+// Scratch space needed by closest() for a problem of the given size:
+// the two halves of py, then, once the recursive calls are done with
+// the space after that, the central strip. Halves solved in parallel
+// need separate space.
+size_t scratchsize(int size)
+{
+  if (size <= 1 || size <= thresh) return 0;
+  int mid = size/2;
+  size_t below = scratchsize(size-mid);
+  if (parallel(size, grain)) below += scratchsize(mid);
+  return size + max(below, (size_t)size);
+}
+
+// Split [0,size) into n nearly equal chunks
+static inline int chunkstart(int size, int n, int i)
+{
+  return (long)size*i/n;
+}
+
+// Split [0,size) into the i satisfying pred(i) and the rest, keeping
+// their order: move(i,true,k) is called for the kth of the first lot,
+// move(i,false,k) for the kth of the rest. Returns how many satisfied
+// pred.
+template<typename Pred, typename Move>
+int partition(int size, const Pred &pred, const Move &move)
+{
+  if (!parallel(size, parallelscan)) {
+    int n1 = 0, n2 = 0;
+    for (int i = 0; i < size; i++) {
+      if (pred(i)) {
+	move(i, true, n1++);
+      } else {
+	move(i, false, n2++);
+      }
+    }
+    return n1;
+  }
+  // Count each chunk, then each chunk knows where its output goes.
+  int nchunks = pool->size()*chunksperthread;
+  vector<int> count(nchunks+1);
+  pool->parallelfor(nchunks, [&](int c) {
+      int n = 0;
+      for (int i = chunkstart(size,nchunks,c); i < chunkstart(size,nchunks,c+1); i++) {
+	n += pred(i);
+      }
+      count[c+1] = n;
+    });
+  for (int c = 0; c < nchunks; c++) count[c+1] += count[c];
+  pool->parallelfor(nchunks, [&](int c) {
+      int start = chunkstart(size,nchunks,c);
+      int n1 = count[c], n2 = start-count[c];
+      for (int i = start; i < chunkstart(size,nchunks,c+1); i++) {
+	if (pred(i)) {
+	  move(i, true, n1++);
+	} else {
+	  move(i, false, n2++);
+	}
+      }
+    });
+  return count[nchunks];
+}
+
+// Compare each point in the strip [start,end) with the ones following
+// it in the strip, up to delta away in y, returning the smallest
+// distance less than dist.
+template<double Point::*xf, double Point::*yf>
+double stripscan(const int *strip, int start, int end, int npoints,
+		 double dist, double delta)
+{
+  INSTR(int64_t comparisons = 0; int most = 0;)
+  for (int i = start; i < end; i++) {
+    const Point &p1 = points[strip[i]];
+    INSTR(int loops = 0;)
+    for (int j = i+1; j < npoints; j++) {
+      const Point &p2 = points[strip[j]];
+      // Ordered by y, so break if distance too long
+      if (p2.*yf - p1.*yf > delta) break;
+      // We could check if p2 is in the other half and
+      // save a comparison if it isn't.
+      double d = Point::dist2(p1,p2);
+      if (d < dist) dist = d;
+      INSTR(loops++;)
+    }
+    INSTR(comparisons += loops; most = max(most, loops);)
+  }
+  INSTR(countscan(comparisons, most);)
+  return dist;
+}
 
 // Main function, returns distance squared of closest points
 // Templated on member accessors so we can use easily, both x-wise and y-wise.
+// scratch must have room for scratchsize(size) ints.
 
 template<double Point::*xf, double Point::*yf>
-double closest(const int *px, const int *py, int size)
+double closest(const int *px, const int *py, int size, int *scratch)
 {
   if (size <= 1) return infinity;
-  if (size <= thresh) return closest0(px, size);
+  INSTR(Level level;)
+  if (size <= thresh) {
+    INSTR(PhaseTimer timer(PHASE_BASE); stats().basecalls++;)
+    return closest0(px, size);
+  }
 
   int mid = size/2;
   int p0 = px[mid]; // The index of the pivot point.
@@ -101,175 +518,2099 @@ double closest(const int *px, const int *py, int size)
     // Recursive calls. Note that we use both x and y in
     // comparison so we really are splitting input in
     // half, even if we duplicate x coordinates.
-    // We could use Vector::reserve to pre-allocate vectors
-    vector<int> tmp1;
-    vector<int> tmp2;
-    for (int i = 0; i < size; i++) {
-      int p = py[i];
-      if (cmp<xf,yf>(p,p0)) {
-	tmp1.push_back(p);
-      } else {
-	tmp2.push_back(p);
-      }
-    }
+    // The halves go next to each other at the start of the scratch
+    // space, the recursive calls use what comes after.
+    int *tmp1 = scratch;
+    int *tmp2 = scratch+mid;
+    INSTR(PhaseTimer timer(PHASE_SPLIT);)
+    int n1 = partition(size, [=](int i) { return cmp<xf,yf>(py[i],p0); },
+		       [=](int i, bool first, int k) { (first ? tmp1 : tmp2)[k] = py[i]; });
+    INSTR(timer.stop();)
     // Check subarray size
-    assert((int)tmp1.size() == mid);
-    assert((int)tmp2.size() == size-mid);
+    assert(n1 == mid);
+    (void)n1;
     // Recurse, swapping accessors and the x and y arrays.
-    double dist1 = closest<yf,xf>(&tmp1[0], px, mid);
-    double dist2 = closest<yf,xf>(&tmp2[0], px+mid, size-mid);
+    double dist1, dist2;
+    if (parallel(size, grain)) {
+      atomic<int> pending(1);
+      INSTR(int depth = stats().depth;)
+      pool->spawn([&]{
+	  INSTR(TaskDepth task(depth);)
+	  dist1 = closest<yf,xf>(tmp1, px, mid, scratch+size);
+	}, &pending);
+      dist2 = closest<yf,xf>(tmp2, px+mid, size-mid, scratch+size+scratchsize(mid));
+      pool->wait(&pending);
+    } else {
+      dist1 = closest<yf,xf>(tmp1, px, mid, scratch+size);
+      dist2 = closest<yf,xf>(tmp2, px+mid, size-mid, scratch+size);
+    }
 
     dist = min(dist1,dist2);
   }
 
-  // Now find all the points in the central strip, sorted by y
+  // Now find all the points in the central strip, sorted by y.
+  // The halves are finished with, but py may be our caller's
+  // halves, so use the space after them.
   {
-    vector<int> tmp;
+    int64_t start = stripns ? nanos() : 0;
+    int *tmp = scratch+size;
     double x0 = points[p0].*xf; // The position of central line
     double delta = sqrt(dist);  // Get half-strip width
-    for (int i = 0; i < size; i++) {
-      int p = py[i];
-      double x = points[p].*xf;
-      if (x >= x0-delta && x <= x0+delta) {
-	tmp.push_back(p);
-      }
-    };
-    int npoints = tmp.size();
-    for (int i = 0; i < npoints-1; i++) {
-      const Point &p1 = points[tmp[i]];
-      int loops = 0;
-      for (int j= i+1; j < npoints; j++) {
-	const Point &p2 = points[tmp[j]];
-	// Ordered by y, so break if distance too long
-	if (p2.*yf - p1.*yf > delta) break;
-	// We could check if p2 is in the other half and
-	// save a comparison if it isn't.
-	double d = Point::dist2(p1,p2);
-	if (d < dist) dist = d;
-	// Keep track of our loop count
-	loops++;
-	if (loops > maxloops) {
-	  // Biggest I've seen here is 4
-	  cerr << "Loops now " << loops << "\n";
-	  maxloops = loops;
-	}
-      }
+    INSTR(PhaseTimer timer(PHASE_STRIP);)
+    int npoints = partition(size, [=](int i) {
+	double x = points[py[i]].*xf;
+	return x >= x0-delta && x <= x0+delta;
+      }, [=](int i, bool first, int k) { if (first) tmp[k] = py[i]; });
+    INSTR(timer.stop(); countstrip(npoints); PhaseTimer scantimer(PHASE_SCAN);)
+    if (!parallel(npoints, parallelscan)) {
+      dist = stripscan<xf,yf>(tmp, 0, npoints, npoints, dist, delta);
+    } else {
+      int nchunks = pool->size()*chunksperthread;
+      vector<double> dists(nchunks);
+      pool->parallelfor(nchunks, [&](int c) {
+	  dists[c] = stripscan<xf,yf>(tmp, chunkstart(npoints,nchunks,c),
+				      chunkstart(npoints,nchunks,c+1), npoints, dist, delta);
+	});
+      dist = *min_element(dists.begin(), dists.end());
     }
+    if (stripns) *stripns += nanos()-start;
   }
   return dist;
 }
 
-int main(int argc, char *argv[])
+// A generic version of closest(), for coordinates of type T (float,
+// double, int32_t or int64_t) in D dimensions. Everything it uses is
+// in the object, so separate solvers can run at the same time. It
+// keeps the points in order on every axis, and each level splits on
+// the axis the points are most spread out along and scans the strip
+// in order of the most spread of the others, so points that only vary
+// in some of the axes don't end up in every strip. For D > 2 the strip
+// scan still isn't bounded by a constant in general.
+// Equal points are fine: ties are broken on the point index.
+
+// Squared distances: in double for float and double, and exactly, in
+// 128 bits, for the integer types (int64_t coordinates must be within
+// +/-2^62 so a sum of four squares fits).
+template<typename T> struct CoordTraits
 {
-  bool test = false;
-  bool randomize = false;
-  bool printpoints = false;
-  int type = 0;
-  const char *progname = argv[0];
-  argc--; argv++;
-  while (argc > 0) {
-    if (strcmp(argv[0], "-test") == 0) {
-      test = true;
-      argc--; argv++;
-    } else if (strcmp(argv[0], "-t") == 0) {
-      argc--; argv++;
-      thresh = atoi(argv[0]);
-      argc--; argv++;
-    } else if (strcmp(argv[0], "-type") == 0) {
-      argc--; argv++;
-      type = atoi(argv[0]);
-      argc--; argv++;
-    } else if (strcmp(argv[0], "-r") == 0) {
-      argc--; argv++;
-      randomize = true;
-    } else if (strcmp(argv[0], "-p") == 0) {
-      argc--; argv++;
-      printpoints = true;
-    } else {
-      break;
+  typedef double Dist;
+  static Dist sq(T a, T b) { double d = (double)a-b; return d*d; }
+  static Dist infinite() { return numeric_limits<double>::infinity(); }
+};
+
+template<typename T> struct IntCoordTraits
+{
+  typedef unsigned __int128 Dist;
+  static Dist sq(T a, T b) {
+    Dist d = (a < b) ? (Dist)((__int128)b-a) : (Dist)((__int128)a-b);
+    return d*d;
+  }
+  static Dist infinite() { return ~(Dist)0; }
+};
+
+template<> struct CoordTraits<int32_t> : IntCoordTraits<int32_t> {};
+template<> struct CoordTraits<int64_t> : IntCoordTraits<int64_t> {};
+
+template<typename T, int D>
+class Closest
+{
+  static_assert(D >= 2, "Closest needs at least two dimensions");
+public:
+  typedef array<T,D> Vec;
+  typedef CoordTraits<T> Traits;
+  typedef typename Traits::Dist Dist;
+  Closest(int thresh_ = 0) : thresh(thresh_), pts(NULL) {}
+  // The squared distance between the closest pair of the npoints
+  // points, with their indices in *a and *b (or -1 if npoints < 2).
+  Dist solve(const Vec *points, int npoints, int *a, int *b);
+  // The same by brute force, for checking
+  Dist brute(const Vec *points, int npoints, int *a, int *b);
+private:
+  // The points in order on each axis
+  typedef array<const int *,D> Orders;
+  bool less(int axis, int p1, int p2) const;
+  double spread(const Orders &orders, int axis, int size) const;
+  void closest(const Orders &orders, int size, int *scratch);
+  size_t scratchsize(int size) const;
+  void start(const Vec *points);
+  Dist finish(int *a, int *b) const;
+  void check(int p1, int p2) {
+    Dist d = 0;
+    for (int k = 0; k < D; k++) d += Traits::sq(pts[p1][k], pts[p2][k]);
+    if (d < best) {
+      best = d;
+      best1 = p1;
+      best2 = p2;
     }
   }
-  if (argc != 1) {
-    cerr << "Usage: " << progname << " [-r] [-p] [-t threshold] [-test] npoints\n";
-    exit(1);
+  int thresh;
+  const Vec *pts;
+  Dist best; // Closest so far, so all the strips can use it
+  int best1, best2;
+  // Kept from one problem to the next, so a solver used for many
+  // small problems only allocates for the biggest so far
+  vector<int> sorted, scratch;
+};
+
+// Order on the axis, then on the other axes in turn, then on the index
+template<typename T, int D>
+bool Closest<T,D>::less(int axis, int p1, int p2) const
+{
+  if (pts[p1][axis] != pts[p2][axis]) return pts[p1][axis] < pts[p2][axis];
+  for (int k = 0; k < D; k++) {
+    if (k != axis && pts[p1][k] != pts[p2][k]) return pts[p1][k] < pts[p2][k];
   }
+  return p1 < p2;
+}
 
-  int npoints = atoi(argv[0]);
+// How far the points extend along the axis
+template<typename T, int D>
+double Closest<T,D>::spread(const Orders &orders, int axis, int size) const
+{
+  return (double)pts[orders[axis][size-1]][axis] - pts[orders[axis][0]][axis];
+}
 
-  if (randomize) srand(time(NULL));
+// Each level needs the halves of the orders other than the one it
+// splits on, then, once the recursive calls are done, the strip.
+template<typename T, int D>
+size_t Closest<T,D>::scratchsize(int size) const
+{
+  if (size <= 1 || size <= thresh) return 0;
+  return (D-1)*(size_t)size + max(scratchsize(size-size/2), (size_t)size);
+}
 
-  while (true) {
-  restart:
-    points.clear();
-    for (int i = 0; i < npoints; i++) {
-      double x = rand()/(double)RAND_MAX;
-      double y = rand()/(double)RAND_MAX;
-      int ntypes = 11;
-      switch (type%ntypes) {
-      case 0:
-	points.push_back(Point(x,y));
-	break;
-      case 1:
-	points.push_back(Point(1/x,1/y));
-	break;
-      case 2:
-	points.push_back(Point(x,0));
-	break;
-      case 3:
-	points.push_back(Point(0,y));
-	break;
-      case 4:
-	points.push_back(Point(1/x,0));
-	break;
-      case 5:
-	points.push_back(Point(0,1/y));
-	break;
-      case 6:
-	points.push_back(Point(i,0));
-	break;
-      case 7:
-	points.push_back(Point(0,i));
-	break;
-      case 8:
-	points.push_back(Point(i,i));
-	break;
-      case 9:
-	points.push_back(Point(x*x,y*y));
-	break;
-      case 10:
-	points.push_back(Point(1/(x*x),1/(y*y)));
-	break;
-      default:
-	assert(0);
-      }
+template<typename T, int D>
+void Closest<T,D>::start(const Vec *points)
+{
+  pts = points;
+  best = Traits::infinite();
+  best1 = best2 = -1;
+}
+
+template<typename T, int D>
+typename Closest<T,D>::Dist Closest<T,D>::finish(int *a, int *b) const
+{
+  *a = min(best1, best2);
+  *b = max(best1, best2);
+  return best;
+}
+
+template<typename T, int D>
+typename Closest<T,D>::Dist Closest<T,D>::solve(const Vec *points, int npoints, int *a, int *b)
+{
+  start(points);
+  sorted.resize(D*(size_t)npoints);
+  Orders orders;
+  for (int k = 0; k < D; k++) {
+    int *order = sorted.data()+k*(size_t)npoints;
+    for (int i = 0; i < npoints; i++) order[i] = i;
+    sort(order, order+npoints, [this,k](int p1, int p2) { return less(k,p1,p2); });
+    orders[k] = order;
+  }
+  scratch.resize(scratchsize(npoints));
+  closest(orders, npoints, scratch.data());
+  return finish(a, b);
+}
+
+template<typename T, int D>
+typename Closest<T,D>::Dist Closest<T,D>::brute(const Vec *points, int npoints, int *a, int *b)
+{
+  start(points);
+  for (int i = 0; i < npoints-1; i++) {
+    for (int j = i+1; j < npoints; j++) check(i, j);
+  }
+  return finish(a, b);
+}
+
+// orders has the size points in order on each axis. Split on the axis
+// they are most spread along, A, so the halves of orders[A] are already
+// there and the other orders are split into the scratch space; the
+// recursive calls use what comes after, as does the strip.
+template<typename T, int D>
+void Closest<T,D>::closest(const Orders &orders, int size, int *scratch)
+{
+  if (size <= 1) return;
+  INSTR(Level level;)
+  if (size <= thresh) {
+    INSTR(PhaseTimer timer(PHASE_BASE); stats().basecalls++;)
+    const int *p = orders[0];
+    for (int i = 0; i < size-1; i++) {
+      for (int j = i+1; j < size; j++) check(p[i], p[j]);
     }
-    vector<int> px;
-    vector<int> py;
-    for (int i = 0; i < (int)points.size(); i++){
-      px.push_back(i);
-      py.push_back(i);
+    return;
+  }
+  // The split axis, A, and the strip order, B: the most spread out
+  // axis and the next most.
+  int A = 0, B = -1;
+  double spreadA = spread(orders, 0, size), spreadB = -1;
+  for (int k = 1; k < D; k++) {
+    double sk = spread(orders, k, size);
+    if (sk > spreadA) {
+      B = A; spreadB = spreadA;
+      A = k; spreadA = sk;
+    } else if (sk > spreadB) {
+      B = k; spreadB = sk;
     }
-    sort(px.begin(),px.end(),cmpx);
-    sort(py.begin(),py.end(),cmpy);
-    for (int i = 0; i < npoints-1; i++) {
-      if (points[px[i]].x == points[px[i+1]].x &&
-	  points[px[i]].y == points[px[i+1]].y) {
-	cerr << "Equal points!\n";
-	goto restart;
-      }
+  }
+  int mid = size/2;
+  int p0 = orders[A][mid];
+  Orders lower, upper;
+  INSTR(PhaseTimer timer(PHASE_SPLIT);)
+  int *halves = scratch;
+  for (int k = 0; k < D; k++) {
+    if (k == A) {
+      lower[k] = orders[k];
+      upper[k] = orders[k]+mid;
+      continue;
     }
-    type++;
-    if (printpoints) {
-      for (int i = 0; i < npoints; i++) {
-	cerr << points[i].x << " " << points[i].y << "\n";
+    int *tmp1 = halves, *tmp2 = halves+mid;
+    int n1 = 0, n2 = 0;
+    for (int i = 0; i < size; i++) {
+      int p = orders[k][i];
+      if (less(A, p, p0)) tmp1[n1++] = p;
+      else tmp2[n2++] = p;
+    }
+    assert(n1 == mid);
+    lower[k] = tmp1;
+    upper[k] = tmp2;
+    halves += size;
+  }
+  INSTR(timer.stop();)
+  closest(lower, mid, halves);
+  closest(upper, size-mid, halves);
+
+  // The strip, in B order. Comparing squares of the differences with
+  // best avoids a square root, and any rounding, in the tests.
+  INSTR(PhaseTimer striptimer(PHASE_STRIP);)
+  int *strip = halves;
+  int npoints = 0;
+  T x0 = pts[p0][A];
+  for (int i = 0; i < size; i++) {
+    int p = orders[B][i];
+    if (Traits::sq(pts[p][A], x0) <= best) strip[npoints++] = p;
+  }
+  INSTR(striptimer.stop(); countstrip(npoints); PhaseTimer scantimer(PHASE_SCAN);)
+  INSTR(int64_t comparisons = 0; int most = 0;)
+  for (int i = 0; i < npoints; i++) {
+    INSTR(int loops = 0;)
+    for (int j = i+1; j < npoints; j++) {
+      if (Traits::sq(pts[strip[j]][B], pts[strip[i]][B]) > best) break;
+      check(strip[i], strip[j]);
+      INSTR(loops++;)
+    }
+    INSTR(comparisons += loops; most = max(most, loops);)
+  }
+  INSTR(countscan(comparisons, most);)
+}
+
+// The same algorithm on a structure of arrays: instead of index
+// arrays into points, each level has its own contiguous copies of the
+// coordinates, in x and in y order, so there are no gathers and the
+// brute force base case and the strip scan can be vectorized.
+// The coordinates are local to each level: x is the axis being split,
+// and the recursive calls swap them, as with xf and yf above.
+
+// The vectors are GCC vector extensions, so the compiler picks the
+// instructions: 8 lanes for AVX-512, 4 for AVX2, or plain scalar code.
+#if defined __AVX512F__
+#define SIMD_WIDTH 8
+#elif defined __AVX__
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+#if SIMD_WIDTH > 1
+typedef double vdouble __attribute__((vector_size(8*SIMD_WIDTH)));
+typedef int64_t vlong __attribute__((vector_size(8*SIMD_WIDTH)));
+static inline vdouble vload(const double *p) { vdouble v; memcpy(&v, p, sizeof(v)); return v; }
+static inline vdouble vset1(double a) { return vdouble{} + a; }
+static inline vdouble vmin(vdouble a, vdouble b) { return (a < b) ? a : b; }
+static inline double vhmin(vdouble a) {
+  double m = a[0];
+  for (int i = 1; i < SIMD_WIDTH; i++) m = (a[i] < m) ? a[i] : m;
+  return m;
+}
+#else
+typedef double vdouble;
+typedef int64_t vlong;
+static inline vdouble vload(const double *p) { return *p; }
+static inline vdouble vset1(double a) { return a; }
+static inline vdouble vmin(vdouble a, vdouble b) { return (a < b) ? a : b; }
+static inline double vhmin(vdouble a) { return a; }
+#endif
+
+// Distances squared from (x1,y1) to SIMD_WIDTH points. NaNs (from
+// infinite coordinates) never win a vmin(d, ...).
+static inline vdouble vdist2(vdouble x1, vdouble y1, const double *x2, const double *y2)
+{
+  vdouble dx = vload(x2) - x1;
+  vdouble dy = vload(y2) - y1;
+  return dx*dx + dy*dy;
+}
+
+static inline double dist2(double x1, double y1, double x2, double y2)
+{
+  double dx = x2-x1;
+  double dy = y2-y1;
+  return dx*dx+dy*dy;
+}
+
+// Brute force, on contiguous coordinates
+double closest0soa(const double *x, const double *y, int size)
+{
+  double dist = infinity;
+  vdouble vdist = vset1(infinity);
+  for (int i = 0; i < size-1; i++) {
+    vdouble xi = vset1(x[i]), yi = vset1(y[i]);
+    int j = i+1;
+    for ( ; j+SIMD_WIDTH <= size; j += SIMD_WIDTH) {
+      vdist = vmin(vdist2(xi, yi, x+j, y+j), vdist);
+    }
+    for ( ; j < size; j++) {
+      double d = dist2(x[i],y[i],x[j],y[j]);
+      if (d < dist) dist = d;
+    }
+  }
+  return min(dist, vhmin(vdist));
+}
+
+// As stripscan(), on contiguous coordinates in y order. A whole vector
+// of following points is checked at a time: any beyond delta in y are
+// further away than dist, so including them does no harm.
+double stripscansoa(const double *x, const double *y, int start, int end, int npoints,
+		    double dist, double delta)
+{
+  vdouble vdist = vset1(dist);
+  INSTR(int64_t comparisons = 0; int most = 0;)
+  for (int i = start; i < end; i++) {
+    vdouble xi = vset1(x[i]), yi = vset1(y[i]);
+    int j = i+1;
+    for ( ; j+SIMD_WIDTH <= npoints; j += SIMD_WIDTH) {
+      vdist = vmin(vdist2(xi, yi, x+j, y+j), vdist);
+      if (y[j+SIMD_WIDTH-1] - y[i] > delta) break;
+    }
+    // Whole vectors count as compared
+    INSTR(int loops = j-(i+1) + (j+SIMD_WIDTH <= npoints ? SIMD_WIDTH : 0);
+	  comparisons += loops; most = max(most, loops);)
+    if (j+SIMD_WIDTH <= npoints) continue;
+    for ( ; j < npoints; j++) {
+      if (y[j] - y[i] > delta) break;
+      double d = dist2(x[i],y[i],x[j],y[j]);
+      if (d < dist) dist = d;
+    }
+    INSTR(comparisons += j-(i+1)-loops; most = max(most, j-(i+1));)
+  }
+  INSTR(countscan(comparisons, most);)
+  return min(dist, vhmin(vdist));
+}
+
+// (ax,ay) are the points in x order, (bx,by) the same points in y
+// order. scratch must have room for 2*scratchsize(size) doubles,
+// laid out as for closest() with two doubles for each int.
+double closestsoa(const double *ax, const double *ay,
+		  const double *bx, const double *by, int size, double *scratch)
+{
+  if (size <= 1) return infinity;
+  INSTR(Level level;)
+  if (size <= thresh) {
+    INSTR(PhaseTimer timer(PHASE_BASE); stats().basecalls++;)
+    return closest0soa(ax, ay, size);
+  }
+
+  int mid = size/2;
+  double x0 = ax[mid], y0 = ay[mid]; // The pivot point
+
+  double dist;
+  {
+    // The halves, in y order, as x coordinates then y coordinates.
+    double *x1 = scratch, *x2 = scratch+mid;
+    double *y1 = scratch+size, *y2 = scratch+size+mid;
+    INSTR(PhaseTimer timer(PHASE_SPLIT);)
+    partition(size, [=](int i) { return bx[i] < x0 || (bx[i] == x0 && by[i] < y0); },
+	      [=](int i, bool first, int k) {
+		if (first) { x1[k] = bx[i]; y1[k] = by[i]; }
+		else { x2[k] = bx[i]; y2[k] = by[i]; }
+	      });
+    INSTR(timer.stop();)
+    // Recurse, swapping the axes: the halves in y order become the
+    // x order for the next level.
+    double *below = scratch+2*size;
+    double dist1, dist2;
+    if (parallel(size, grain)) {
+      atomic<int> pending(1);
+      INSTR(int depth = stats().depth;)
+      pool->spawn([&]{
+	  INSTR(TaskDepth task(depth);)
+	  dist1 = closestsoa(y1, x1, ay, ax, mid, below);
+	}, &pending);
+      dist2 = closestsoa(y2, x2, ay+mid, ax+mid, size-mid, below+2*scratchsize(mid));
+      pool->wait(&pending);
+    } else {
+      dist1 = closestsoa(y1, x1, ay, ax, mid, below);
+      dist2 = closestsoa(y2, x2, ay+mid, ax+mid, size-mid, below);
+    }
+    dist = min(dist1,dist2);
+  }
+
+  // The strip, in y order, after the halves.
+  {
+    int64_t start = stripns ? nanos() : 0;
+    double *sx = scratch+2*size, *sy = scratch+3*size;
+    double delta = sqrt(dist);
+    INSTR(PhaseTimer timer(PHASE_STRIP);)
+    int npoints = partition(size, [=](int i) { return bx[i] >= x0-delta && bx[i] <= x0+delta; },
+			    [=](int i, bool first, int k) {
+			      if (first) { sx[k] = bx[i]; sy[k] = by[i]; }
+			    });
+    INSTR(timer.stop(); countstrip(npoints); PhaseTimer scantimer(PHASE_SCAN);)
+    if (!parallel(npoints, parallelscan)) {
+      dist = stripscansoa(sx, sy, 0, npoints, npoints, dist, delta);
+    } else {
+      int nchunks = pool->size()*chunksperthread;
+      vector<double> dists(nchunks);
+      pool->parallelfor(nchunks, [&](int c) {
+	  dists[c] = stripscansoa(sx, sy, chunkstart(npoints,nchunks,c),
+				  chunkstart(npoints,nchunks,c+1), npoints, dist, delta);
+	});
+      dist = *min_element(dists.begin(), dists.end());
+    }
+    if (stripns) *stripns += nanos()-start;
+  }
+  return dist;
+}
+
+// Closest pairs for a batch of independent point sets, packed one
+// after another in pts: set s is pts[offsets[s]] to pts[offsets[s+1]-1].
+// Small sets use a SIMD brute force, bigger ones the generic solver.
+// With -j the sets are shared out between the threads a block at a
+// time. Each thread reuses its buffers from one set to the next.
+
+struct PairResult
+{
+  double dist; // Squared, infinity for sets of less than 2 points
+  int a, b;    // Indices within the set, a < b, or -1
+};
+
+// Sets up to this size use brute force: it is quadratic, but each
+// lane beats the generic solver up to a couple of hundred points.
+const int batchbrute = 192*SIMD_WIDTH;
+// Sets given to a thread at a time
+const int batchblock = 64;
+
+// As closest0soa(), also finding the pair: each lane keeps the
+// position of its best so far, i in the top half, j in the bottom.
+double closest0pair(const double *x, const double *y, int size, int *a, int *b)
+{
+  int64_t lanes[SIMD_WIDTH];
+  for (int l = 0; l < SIMD_WIDTH; l++) lanes[l] = l;
+  vlong vlanes;
+  memcpy(&vlanes, lanes, sizeof(vlanes));
+  vdouble vdist = vset1(infinity);
+  vlong vbest = vlong{} - 1;
+  double dist = infinity;
+  int64_t best = -1;
+  for (int i = 0; i < size-1; i++) {
+    vdouble xi = vset1(x[i]), yi = vset1(y[i]);
+    vlong vpos = vlanes + ((int64_t)i << 32);
+    int j = i+1;
+    for ( ; j+SIMD_WIDTH <= size; j += SIMD_WIDTH) {
+      vdouble d = vdist2(xi, yi, x+j, y+j);
+      vbest = (d < vdist) ? vpos+j : vbest;
+      vdist = vmin(d, vdist);
+    }
+    for ( ; j < size; j++) {
+      double d = dist2(x[i],y[i],x[j],y[j]);
+      if (d < dist) {
+	dist = d;
+	best = ((int64_t)i << 32) + j;
+      }
+    }
+  }
+  double dists[SIMD_WIDTH];
+  int64_t bests[SIMD_WIDTH];
+  memcpy(dists, &vdist, sizeof(dists));
+  memcpy(bests, &vbest, sizeof(bests));
+  for (int l = 0; l < SIMD_WIDTH; l++) {
+    if (dists[l] < dist) {
+      dist = dists[l];
+      best = bests[l];
+    }
+  }
+  *a = (best < 0) ? -1 : best >> 32;
+  *b = (best < 0) ? -1 : (int)best;
+  return dist;
+}
+
+struct BatchWorkspace
+{
+  BatchWorkspace(int thresh) : solver(thresh) {}
+  vector<double> x, y;
+  vector<Closest<double,2>::Vec> vecs;
+  Closest<double,2> solver;
+};
+
+static void closestset(const Point *pts, int size, BatchWorkspace &ws, PairResult &result)
+{
+  if (size <= batchbrute) {
+    ws.x.resize(size);
+    ws.y.resize(size);
+    for (int i = 0; i < size; i++) {
+      ws.x[i] = pts[i].x;
+      ws.y[i] = pts[i].y;
+    }
+    result.dist = closest0pair(ws.x.data(), ws.y.data(), size, &result.a, &result.b);
+  } else {
+    ws.vecs.resize(size);
+    for (int i = 0; i < size; i++) ws.vecs[i] = {{ pts[i].x, pts[i].y }};
+    result.dist = ws.solver.solve(ws.vecs.data(), size, &result.a, &result.b);
+  }
+}
+
+void closestbatch(const Point *pts, const size_t *offsets, int nsets, PairResult *results)
+{
+  int nworkers = pool ? pool->size() : 1;
+  vector<BatchWorkspace> workspaces(nworkers, BatchWorkspace(thresh));
+  atomic<int> next(0);
+  auto work = [&](int w) {
+    int start;
+    while ((start = next.fetch_add(batchblock)) < nsets) {
+      for (int s = start; s < min(start+batchblock, nsets); s++) {
+	closestset(pts+offsets[s], offsets[s+1]-offsets[s], workspaces[w], results[s]);
+      }
+    }
+  };
+  if (pool) pool->parallelfor(nworkers, work);
+  else work(0);
+}
+
+// Cell coordinates are clamped to where doubles still represent
+// every integer, so huge or infinite coordinates just share cells at
+// the edges, which costs time but not correctness.
+static inline int64_t cellcoord(double x, double size)
+{
+  const double limit = 0x1p52;
+  double c = floor(x/size);
+  if (!(c > -limit)) return -limit; // Including NaN
+  if (c > limit) return limit;
+  return c;
+}
+
+// Cells next to each other in x hash to consecutive values
+static inline uint64_t cellhash(int64_t x, int64_t y)
+{
+  uint64_t h = y*0x9e3779b97f4a7c15ULL;
+  return (h ^ (h >> 29)) + x;
+}
+
+// Expected linear time closest pair, by randomized incremental
+// construction on a grid (as in Khuller and Matias, or Golin et al.):
+// take the points in random order, keeping a grid of cells the size
+// of the closest distance so far, so each new point need only be
+// checked against the 3x3 cells around it. If it is closer than that
+// to one of them, the grid is rebuilt for the new distance, which
+// happens with probability at most 2/i for the ith point, so the
+// expected total work is O(n), with no sorting.
+// Cells are in a flat open addressing table, each with a list of its
+// points (at most 4, as they are all the cell size apart). The hash
+// puts cells next to each other in x in adjacent slots, so a 3x3
+// neighbourhood is about 3 cache misses, not 9.
+class Grid
+{
+public:
+  Grid() : rng(12345) {}
+  // Returns the distance squared of the closest pair of points.
+  double closest(const Point *points, int npoints);
+private:
+  struct Cell { int64_t x, y; int head; }; // head is -1 if empty
+  Cell *find(int64_t x, int64_t y, bool create);
+  double check(int p, double dist);
+  void insert(int p);
+  void rebuild(int npoints, double dist);
+  double cellsize;
+  vector<Point> pts; // The points, in random order
+  vector<Cell> table; // A power of 2, at least twice the number of points
+  vector<int> used; // Slots in use, to clear them quickly
+  vector<int> next; // Next point in the same cell, or -1
+  mt19937 rng;
+};
+
+Grid::Cell *Grid::find(int64_t x, int64_t y, bool create)
+{
+  size_t mask = table.size()-1;
+  size_t h = cellhash(x, y) & mask;
+  while (true) {
+    Cell &c = table[h];
+    if (c.head < 0) {
+      if (!create) return NULL;
+      c.x = x; c.y = y;
+      used.push_back(h);
+      return &c;
+    }
+    if (c.x == x && c.y == y) return &c;
+    h = (h+1) & mask;
+  }
+}
+
+// The distance squared from point p to the closest in the cells
+// around it, if less than dist, else dist.
+double Grid::check(int p, double dist)
+{
+  const Point &p1 = pts[p];
+  int64_t cx = cellcoord(p1.x, cellsize), cy = cellcoord(p1.y, cellsize);
+  for (int64_t y = cy-1; y <= cy+1; y++) {
+    for (int64_t x = cx-1; x <= cx+1; x++) {
+      Cell *c = find(x, y, false);
+      if (c == NULL) continue;
+      for (int q = c->head; q >= 0; q = next[q]) {
+	double d = Point::dist2(p1, pts[q]);
+	if (d < dist) dist = d;
+      }
+    }
+  }
+  return dist;
+}
+
+void Grid::insert(int p)
+{
+  const Point &p1 = pts[p];
+  Cell *c = find(cellcoord(p1.x, cellsize), cellcoord(p1.y, cellsize), true);
+  next[p] = c->head;
+  c->head = p;
+}
+
+// Make the grid for the first npoints points, for cells of the given
+// distance (squared).
+void Grid::rebuild(int npoints, double dist)
+{
+  for (size_t i = 0; i < used.size(); i++) table[used[i]].head = -1;
+  used.clear();
+  cellsize = sqrt(dist);
+  for (int i = 0; i < npoints; i++) insert(i);
+}
+
+double Grid::closest(const Point *points, int npoints)
+{
+  if (npoints < 2) return infinity;
+  size_t tablesize = 1;
+  while (tablesize < 2*(size_t)npoints) tablesize *= 2;
+  if (table.size() < tablesize) {
+    Cell empty = { 0, 0, -1 };
+    table.assign(tablesize, empty);
+    used.clear();
+  }
+  next.resize(npoints);
+  pts.assign(points, points+npoints);
+  shuffle(pts.begin(), pts.end(), rng);
+
+  double dist = Point::dist2(pts[0], pts[1]);
+  // Until there is a finite distance, everything is in one cell
+  if (!(dist < infinity)) dist = infinity;
+  rebuild(2, dist);
+  for (int i = 2; i < npoints && dist > 0; i++) {
+    double d = check(i, dist);
+    if (d < dist) {
+      dist = d;
+      rebuild(i+1, dist);
+    } else {
+      insert(i);
+    }
+  }
+  return dist;
+}
+
+// A closest pair structure for points that come and go. Points are
+// in a grid, with cells a little bigger than the closest distance,
+// and each point knows its nearest neighbour within the 3x3 cells
+// around it. A heap of those, with stale entries skipped as they come
+// to the top, gives the closest pair. Inserting or erasing a point
+// only affects the points around it, so updates take time
+// proportional to the number of points per cell. The grid is rebuilt
+// (in expected linear time, with Grid) when no pair is within a cell
+// of each other any more, as the closest pair could then be anywhere,
+// and when updates are looking at too many points, once there have
+// been enough of them to pay for it. Cells are a multiple of the
+// closest distance, adjusted each time: bigger if the last rebuild
+// had to be done too soon, smaller if the cells got crowded.
+class Dynamic
+{
+public:
+  Dynamic() : cellsize(0), scale(2), ncells(0), npoints(0), builtpoints(0), updates(0), visited(0) {}
+  // Add a point, returning its id. Ids of erased points are reused.
+  int insert(const Point &p);
+  void erase(int id);
+  void move(int id, const Point &p) { erase(id); insert(p); }
+  // Returns the distance squared of the closest pair, setting *a and
+  // *b to their ids, or infinity (and -1) if there is no pair.
+  double closestpair(int *a, int *b);
+  int size() const { return npoints; }
+  int maxid() const { return pts.size(); }
+  bool live(int id) const { return alive[id]; }
+  const Point &point(int id) const { return pts[id]; }
+private:
+  // Cells stay in the table, maybe empty, until the next rebuild
+  struct Cell { int64_t x, y; int head; bool used; };
+  struct Candidate {
+    double d; int p; unsigned stamp;
+    bool operator<(const Candidate &c) const { return d > c.d; } // For a min-heap
+  };
+  Cell *find(int64_t x, int64_t y, bool create);
+  template<typename F> void neighbours(int p, const F &f);
+  void link(int p);
+  void unlink(int p);
+  void nearest(int p);
+  void push(int p);
+  bool valid(const Candidate &c) const { return alive[c.p] && stamp[c.p] == c.stamp; }
+  void rebuild(double rescale = 1);
+  double cellsize;
+  double scale; // Of cellsize to the closest distance
+  vector<Cell> table; // A power of 2, at least 4 times the points at the last rebuild
+  int ncells;
+  vector<Point> pts; // Indexed by id
+  vector<char> alive;
+  vector<int> cellof; // Slot of the point's cell
+  vector<int> next, prev; // Points in the same cell
+  vector<int> nn; // Nearest neighbour in the cells around, or -1
+  vector<double> nnd; // Its distance squared
+  vector<unsigned> stamp; // Changes when nn does, to spot stale candidates
+  vector<int> freeids;
+  vector<Candidate> heap;
+  int npoints;
+  int builtpoints; // At the last rebuild
+  int updates; // Since the last rebuild
+  long visited; // Points looked at, since the last rebuild
+  Grid grid;
+};
+
+Dynamic::Cell *Dynamic::find(int64_t x, int64_t y, bool create)
+{
+  size_t mask = table.size()-1;
+  size_t h = cellhash(x, y) & mask;
+  while (true) {
+    Cell &c = table[h];
+    if (!c.used) {
+      if (!create) return NULL;
+      c.x = x; c.y = y; c.head = -1; c.used = true;
+      ncells++;
+      return &c;
+    }
+    if (c.x == x && c.y == y) return &c;
+    h = (h+1) & mask;
+  }
+}
+
+// Call f(q) for each point q in the 3x3 cells around point p
+template<typename F>
+void Dynamic::neighbours(int p, const F &f)
+{
+  int64_t cx = cellcoord(pts[p].x, cellsize), cy = cellcoord(pts[p].y, cellsize);
+  for (int64_t y = cy-1; y <= cy+1; y++) {
+    for (int64_t x = cx-1; x <= cx+1; x++) {
+      Cell *c = find(x, y, false);
+      if (c == NULL) continue;
+      for (int q = c->head; q >= 0; q = next[q]) {
+	if (q != p) f(q);
+	visited++;
+      }
+    }
+  }
+}
+
+void Dynamic::link(int p)
+{
+  Cell *c = find(cellcoord(pts[p].x, cellsize), cellcoord(pts[p].y, cellsize), true);
+  cellof[p] = c - &table[0];
+  prev[p] = -1;
+  next[p] = c->head;
+  if (c->head >= 0) prev[c->head] = p;
+  c->head = p;
+}
+
+void Dynamic::unlink(int p)
+{
+  if (prev[p] >= 0) next[prev[p]] = next[p];
+  else table[cellof[p]].head = next[p];
+  if (next[p] >= 0) prev[next[p]] = prev[p];
+}
+
+void Dynamic::push(int p)
+{
+  stamp[p]++;
+  if (nn[p] < 0) return;
+  heap.push_back(Candidate{nnd[p], p, stamp[p]});
+  push_heap(heap.begin(), heap.end());
+}
+
+// Find the nearest neighbour of p from scratch
+void Dynamic::nearest(int p)
+{
+  nn[p] = -1;
+  nnd[p] = infinity;
+  neighbours(p, [&](int q) {
+      double d = Point::dist2(pts[p], pts[q]);
+      if (d < nnd[p]) { nnd[p] = d; nn[p] = q; }
+    });
+  push(p);
+}
+
+int Dynamic::insert(const Point &point)
+{
+  int p;
+  if (!freeids.empty()) {
+    p = freeids.back();
+    freeids.pop_back();
+    pts[p] = point;
+  } else {
+    p = pts.size();
+    pts.push_back(point);
+    alive.push_back(0);
+    for (vector<int> *v : { &cellof, &next, &prev, &nn }) v->push_back(-1);
+    nnd.push_back(infinity);
+    stamp.push_back(0);
+  }
+  alive[p] = 1;
+  npoints++;
+  updates++;
+  // Rebuild as the points double, or the table fills up with cells
+  if (npoints > 2*builtpoints || 2*(size_t)ncells >= table.size()) {
+    rebuild();
+    return p;
+  }
+  link(p);
+  nn[p] = -1;
+  nnd[p] = infinity;
+  neighbours(p, [&](int q) {
+      double d = Point::dist2(pts[p], pts[q]);
+      if (d < nnd[p]) { nnd[p] = d; nn[p] = q; }
+      if (d < nnd[q]) { nnd[q] = d; nn[q] = p; push(q); }
+    });
+  push(p);
+  return p;
+}
+
+void Dynamic::erase(int p)
+{
+  assert(alive[p]);
+  unlink(p);
+  alive[p] = 0;
+  npoints--;
+  updates++;
+  freeids.push_back(p);
+  neighbours(p, [&](int q) { if (nn[q] == p) nearest(q); });
+  // Don't let stale candidates pile up
+  if (heap.size() > 4*(size_t)npoints + 64) {
+    heap.clear();
+    for (int q = 0; q < (int)pts.size(); q++) {
+      if (alive[q] && nn[q] >= 0) heap.push_back(Candidate{nnd[q], q, stamp[q]});
+    }
+    make_heap(heap.begin(), heap.end());
+  }
+}
+
+// Start again, with the cell size scaled by rescale
+void Dynamic::rebuild(double rescale)
+{
+  scale = min(max(scale*rescale, 2.0), 1e6);
+  updates = 0;
+  visited = 0;
+  builtpoints = npoints;
+  vector<Point> live;
+  double xmin = infinity, xmax = -infinity, ymin = infinity, ymax = -infinity;
+  for (int p = 0; p < (int)pts.size(); p++) {
+    if (!alive[p]) continue;
+    live.push_back(pts[p]);
+    xmin = min(xmin, pts[p].x); xmax = max(xmax, pts[p].x);
+    ymin = min(ymin, pts[p].y); ymax = max(ymax, pts[p].y);
+  }
+  cellsize = scale*sqrt(grid.closest(live.data(), live.size()));
+  // For equal points (or none finite), about one point per cell
+  if (!(cellsize > 0 && cellsize < infinity)) {
+    cellsize = max(xmax-xmin, ymax-ymin)/sqrt(max(npoints,1));
+  }
+  if (!(cellsize > 0 && cellsize < infinity)) cellsize = 1;
+  size_t tablesize = 64;
+  while (tablesize < 4*(size_t)npoints) tablesize *= 2;
+  Cell empty = { 0, 0, -1, false };
+  table.assign(tablesize, empty);
+  ncells = 0;
+  heap.clear();
+  for (int p = 0; p < (int)pts.size(); p++) {
+    if (alive[p]) link(p);
+  }
+  for (int p = 0; p < (int)pts.size(); p++) {
+    if (alive[p]) nearest(p);
+  }
+}
+
+double Dynamic::closestpair(int *a, int *b)
+{
+  *a = *b = -1;
+  if (npoints < 2) return infinity;
+  for (int tries = 0; tries < 2; tries++) {
+    while (!heap.empty() && !valid(heap[0])) {
+      pop_heap(heap.begin(), heap.end());
+      heap.pop_back();
+    }
+    // The pair is only certain to be the closest if it's within a
+    // cell of each other.
+    double d = heap.empty() ? infinity : heap[0].d;
+    if (tries == 0) {
+      if (!(d < cellsize*cellsize)) {
+	rebuild(updates < npoints ? 4 : 1);
+	continue;
+      }
+      if (updates >= npoints && visited > 64*(long)updates) {
+	rebuild(0.5);
+	continue;
+      }
+    }
+    if (heap.empty()) return infinity;
+    *a = heap[0].p;
+    *b = nn[*a];
+    return d;
+  }
+  return infinity;
+}
+
+// LSD radix sort for the initial x and y orderings. Coordinates are
+// mapped to integers that sort in the same order (with -0 the same as
+// 0, as for <), with ties broken on the other coordinate as for cmp<>.
+// One pass over the points gets the keys and the digit counts for
+// both orderings, and digits that are the same for every point are
+// skipped (eg. the exponent for points in [0,1]). With a pool, each
+// pass is split between the threads, and the two orderings are sorted
+// at the same time.
+
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_DIGITS ((64+RADIX_BITS-1)/RADIX_BITS)
+
+static inline uint64_t bits(double a)
+{
+  uint64_t n;
+  memcpy(&n, &a, sizeof(n));
+  return n;
+}
+
+static inline uint64_t sortkey(double a)
+{
+  uint64_t u = bits(a + 0.0);
+  return (u >> 63) ? ~u : u | (1ULL << 63);
+}
+
+static inline int digit(uint64_t key, int d)
+{
+  return (key >> d*RADIX_BITS) & (RADIX_SIZE-1);
+}
+
+struct RadixItem
+{
+  uint64_t key;
+  int index;
+};
+
+typedef int RadixCounts[RADIX_DIGITS][RADIX_SIZE];
+
+// One stable pass on digit d from in to out.
+static void radixpass(const RadixItem *in, RadixItem *out, int size, int d, const int *count)
+{
+  if (!parallel(size, parallelscan)) {
+    int offset[RADIX_SIZE];
+    for (int i = 0, sum = 0; i < RADIX_SIZE; i++) {
+      offset[i] = sum;
+      sum += count[i];
+    }
+    for (int i = 0; i < size; i++) out[offset[digit(in[i].key,d)]++] = in[i];
+    return;
+  }
+  // Each chunk counts its own digits, then its output for each digit
+  // goes after all the earlier chunks'.
+  int nchunks = pool->size();
+  vector<int> offset(nchunks*RADIX_SIZE);
+  pool->parallelfor(nchunks, [&](int c) {
+      int *o = &offset[c*RADIX_SIZE];
+      for (int i = chunkstart(size,nchunks,c); i < chunkstart(size,nchunks,c+1); i++) {
+	o[digit(in[i].key,d)]++;
+      }
+    });
+  for (int i = 0, sum = 0; i < RADIX_SIZE; i++) {
+    for (int c = 0; c < nchunks; c++) {
+      int n = offset[c*RADIX_SIZE+i];
+      offset[c*RADIX_SIZE+i] = sum;
+      sum += n;
+    }
+  }
+  pool->parallelfor(nchunks, [&](int c) {
+      int *o = &offset[c*RADIX_SIZE];
+      for (int i = chunkstart(size,nchunks,c); i < chunkstart(size,nchunks,c+1); i++) {
+	out[o[digit(in[i].key,d)]++] = in[i];
+      }
+    });
+}
+
+// Sort into order by (primary, secondary), returning the indices in
+// result. buf must have room for 2*size items. Ties on the primary key
+// are usually rare, so they are sorted out afterwards with std::sort.
+static void radixsort(const uint64_t *primary, const uint64_t *secondary,
+		      RadixCounts &count, int size, RadixItem *buf, int *result)
+{
+  RadixItem *in = buf, *out = buf+size;
+  for (int i = 0; i < size; i++) {
+    in[i].key = primary[i];
+    in[i].index = i;
+  }
+  for (int d = 0; d < RADIX_DIGITS; d++) {
+    if (count[d][digit(in[0].key,d)] == size) continue;
+    radixpass(in, out, size, d, count[d]);
+    swap(in, out);
+  }
+  for (int i = 0; i < size; ) {
+    int j = i+1;
+    while (j < size && in[j].key == in[i].key) j++;
+    if (j-i > 1) {
+      for (int k = i; k < j; k++) in[k].key = secondary[in[k].index];
+      sort(in+i, in+j, [](const RadixItem &a, const RadixItem &b) { return a.key < b.key; });
+    }
+    i = j;
+  }
+  for (int i = 0; i < size; i++) result[i] = in[i].index;
+}
+
+// Fill px and py with the point indices in cmpx and cmpy order.
+void sortpoints(const Point *points, int size, int *px, int *py)
+{
+  if (size == 0) return;
+  vector<uint64_t> kx(size), ky(size);
+  vector<RadixCounts> counts(2);
+  memset(counts.data(), 0, 2*sizeof(RadixCounts));
+  RadixCounts &cx = counts[0], &cy = counts[1];
+  for (int i = 0; i < size; i++) {
+    uint64_t x = sortkey(points[i].x), y = sortkey(points[i].y);
+    kx[i] = x; ky[i] = y;
+    for (int d = 0; d < RADIX_DIGITS; d++) {
+      cx[d][digit(x,d)]++;
+      cy[d][digit(y,d)]++;
+    }
+  }
+  vector<RadixItem> buf(4*size);
+  if (pool != NULL) {
+    atomic<int> pending(1);
+    pool->spawn([&]{ radixsort(kx.data(), ky.data(), cx, size, &buf[0], px); }, &pending);
+    radixsort(ky.data(), kx.data(), cy, size, &buf[2*size], py);
+    pool->wait(&pending);
+  } else {
+    radixsort(kx.data(), ky.data(), cx, size, &buf[0], px);
+    radixsort(ky.data(), kx.data(), cy, size, &buf[2*size], py);
+  }
+}
+
+// An implicit kd-tree, for k closest pairs and all nearest
+// neighbours. The points are stored in tree order: the splitting point
+// of a range is at its middle, with the left subtree before it and the
+// right after, so there are no pointers and every subtree is
+// contiguous. It is built from the x and y orderings without sorting,
+// splitting alternately on x and y as in closest(). Small ranges are
+// leaves, searched straight through.
+class KdTree
+{
+public:
+  struct Pair {
+    double d; int a, b;
+    bool operator<(const Pair &p) const { return d < p.d; }
+  };
+  KdTree(const int *px, const int *py, int size);
+  // The nearest neighbour of each point, and its distance squared,
+  // indexed by point.
+  void allnearest(vector<int> &nn, vector<double> &dist) const;
+  // The k closest pairs, closest first.
+  void kclosest(int k, vector<Pair> &pairs) const;
+private:
+  enum { LEAFSIZE = 8 };
+  void build(const int *px, const int *py, int lo, int hi, int axis, int *scratch);
+  template<typename Visit>
+  void search(int q, int lo, int hi, int axis, const double &bound, const Visit &visit) const;
+  int size;
+  vector<double> coord[2]; // x and y, in tree order
+  vector<int> id; // Index in points
+};
+
+static inline bool before(int axis, int p1, int p2)
+{
+  return axis == 0 ? cmp<&Point::x, &Point::y>(p1,p2) : cmp<&Point::y, &Point::x>(p1,p2);
+}
+
+KdTree::KdTree(const int *px, const int *py, int size_)
+  : size(size_), id(size_)
+{
+  coord[0].resize(size);
+  coord[1].resize(size);
+  vector<int> scratch(2*size + 64);
+  build(px, py, 0, size, 0, scratch.data());
+  for (int i = 0; i < size; i++) {
+    coord[0][i] = points[id[i]].x;
+    coord[1][i] = points[id[i]].y;
+  }
+}
+
+// px is the range [lo,hi) in order on the splitting axis, py in order
+// on the other one.
+void KdTree::build(const int *px, const int *py, int lo, int hi, int axis, int *scratch)
+{
+  int n = hi-lo;
+  if (n <= LEAFSIZE) {
+    copy(px, px+n, &id[lo]);
+    return;
+  }
+  int mid = n/2;
+  int p0 = px[mid];
+  id[lo+mid] = p0;
+  // The two sides, in order on the other axis, leaving out the pivot
+  int *left = scratch, *right = scratch+mid;
+  int n1 = 0, n2 = 0;
+  for (int i = 0; i < n; i++) {
+    int p = py[i];
+    if (p == p0) continue;
+    if (before(axis, p, p0)) left[n1++] = p;
+    else right[n2++] = p;
+  }
+  assert(n1 == mid && n2 == n-mid-1);
+  build(left, px, lo, lo+mid, 1-axis, scratch+n);
+  build(right, px+mid+1, lo+mid+1, hi, 1-axis, scratch+n);
+}
+
+// Call visit(j,d) for the points j (other than q) in [lo,hi) closer
+// to q than bound, which visit may reduce as it goes.
+template<typename Visit>
+void KdTree::search(int q, int lo, int hi, int axis, const double &bound, const Visit &visit) const
+{
+  const double *x = coord[0].data(), *y = coord[1].data();
+  double qx = x[q], qy = y[q];
+  if (hi-lo <= LEAFSIZE) {
+    for (int j = lo; j < hi; j++) {
+      double dx = x[j]-qx, dy = y[j]-qy;
+      double d = dx*dx+dy*dy;
+      if (d < bound && j != q) visit(j,d);
+    }
+    return;
+  }
+  int mid = lo+(hi-lo)/2;
+  double dx = x[mid]-qx, dy = y[mid]-qy;
+  double d = dx*dx+dy*dy;
+  if (d < bound && mid != q) visit(mid,d);
+  double diff = coord[axis][q] - coord[axis][mid];
+  if (diff < 0) {
+    search(q, lo, mid, 1-axis, bound, visit);
+    if (diff*diff < bound) search(q, mid+1, hi, 1-axis, bound, visit);
+  } else {
+    search(q, mid+1, hi, 1-axis, bound, visit);
+    if (diff*diff < bound) search(q, lo, mid, 1-axis, bound, visit);
+  }
+}
+
+// Run f(start,end) over the points in tree order, so that nearby
+// queries go together, split between the threads if there is a pool.
+template<typename F>
+static void inchunks(int size, const F &f)
+{
+  int nchunks = (pool != NULL) ? pool->size()*chunksperthread : 1;
+  if (pool == NULL) f(0, size);
+  else pool->parallelfor(nchunks, [&](int c) {
+      f(chunkstart(size,nchunks,c), chunkstart(size,nchunks,c+1));
+    });
+}
+
+void KdTree::allnearest(vector<int> &nn, vector<double> &dist) const
+{
+  nn.assign(size, -1);
+  dist.assign(size, infinity);
+  inchunks(size, [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+	double best = infinity;
+	int nearest = -1;
+	search(i, 0, size, 0, best, [&](int j, double d) { best = d; nearest = j; });
+	if (nearest >= 0) nn[id[i]] = id[nearest];
+	dist[id[i]] = best;
+      }
+    });
+}
+
+void KdTree::kclosest(int k, vector<Pair> &pairs) const
+{
+  pairs.clear();
+  if (k <= 0 || size < 2) return;
+  // The nearest neighbour pairs are real pairs, so if there are k of
+  // them, the kth closest is a starting bound for the search.
+  vector<int> nn;
+  vector<double> dist;
+  allnearest(nn, dist);
+  vector<double> nndist;
+  for (int i = 0; i < size; i++) {
+    if (nn[i] >= 0 && (i < nn[i] || nn[nn[i]] != i)) nndist.push_back(dist[i]);
+  }
+  double bound0 = infinity;
+  if ((int)nndist.size() >= k) {
+    nth_element(nndist.begin(), nndist.begin()+k-1, nndist.end());
+    bound0 = nextafter(nndist[k-1], infinity);
+  }
+  // Each chunk keeps its own bounded max-heap of pairs, each pair
+  // found from the point with the lower index.
+  mutex m;
+  inchunks(size, [&](int start, int end) {
+      vector<Pair> heap;
+      double bound = bound0;
+      for (int i = start; i < end; i++) {
+	search(i, 0, size, 0, bound, [&](int j, double d) {
+	    if (id[j] < id[i]) return;
+	    heap.push_back(Pair{d, id[i], id[j]});
+	    push_heap(heap.begin(), heap.end());
+	    if ((int)heap.size() > k) {
+	      pop_heap(heap.begin(), heap.end());
+	      heap.pop_back();
+	    }
+	    if ((int)heap.size() == k) bound = min(bound, heap[0].d);
+	  });
+      }
+      lock_guard<mutex> lock(m);
+      pairs.insert(pairs.end(), heap.begin(), heap.end());
+    });
+  sort(pairs.begin(), pairs.end());
+  if ((int)pairs.size() > k) pairs.resize(k);
+}
+
+// The -k and -nn queries, checked against brute force with test.
+void runkdtree(const int *px, const int *py, int npoints, int k, bool allnn, bool test)
+{
+  KdTree tree(px, py, npoints);
+  if (allnn) {
+    vector<int> nn;
+    vector<double> dist;
+    tree.allnearest(nn, dist);
+    double sum = 0, maxd = 0;
+    for (int i = 0; i < npoints; i++) {
+      double d = sqrt(dist[i]);
+      sum += d;
+      maxd = max(maxd, d);
+      if (test) {
+	double d0 = infinity;
+	for (int j = 0; j < npoints; j++) {
+	  if (j != i) d0 = min(d0, Point::dist2(points[i], points[j]));
+	}
+	assert(dist[i] == d0);
+	assert(nn[i] < 0 || dist[i] == Point::dist2(points[i], points[nn[i]]));
+      }
+    }
+    cout << "nearest neighbours: mean " << sum/npoints << " max " << maxd << "\n";
+  }
+  if (k > 0) {
+    vector<KdTree::Pair> pairs;
+    tree.kclosest(k, pairs);
+    if (test) {
+      vector<double> all;
+      for (int i = 0; i < npoints; i++) {
+	for (int j = i+1; j < npoints; j++) all.push_back(Point::dist2(points[i], points[j]));
+      }
+      sort(all.begin(), all.end());
+      all.resize(min(all.size(), (size_t)k));
+      assert(pairs.size() == all.size());
+      for (size_t i = 0; i < pairs.size(); i++) {
+	assert(pairs[i].d == all[i]);
+	assert(pairs[i].d == Point::dist2(points[pairs[i].a], points[pairs[i].b]));
+      }
+      cout << pairs.size() << " closest pairs ok\n";
+    } else {
+      for (size_t i = 0; i < pairs.size(); i++) {
+	cout << sqrt(pairs[i].d) << " " << pairs[i].a << " " << pairs[i].b << "\n";
+      }
+    }
+  }
+}
+
+// Start with the given points, then move random points by small
+// amounts, finding the closest pair after each move. With test, check
+// each answer against brute force.
+void rundynamic(int npoints, int nupdates, bool test)
+{
+  Dynamic dyn;
+  for (int i = 0; i < npoints; i++) dyn.insert(points[i]);
+  int a, b;
+  double d = dyn.closestpair(&a, &b);
+  double step = 1/sqrt(max(npoints,1));
+  clock_t start = clock();
+  for (int n = 0; n < nupdates; n++) {
+    int p = rand()%dyn.maxid();
+    Point q = dyn.point(p);
+    q.x += step*(rand()/(double)RAND_MAX - 0.5);
+    q.y += step*(rand()/(double)RAND_MAX - 0.5);
+    dyn.move(p, q);
+    d = dyn.closestpair(&a, &b);
+    if (test) {
+      double d0 = infinity;
+      for (int i = 0; i < dyn.maxid(); i++) {
+	for (int j = i+1; j < dyn.maxid(); j++) {
+	  if (!dyn.live(i) || !dyn.live(j)) continue;
+	  d0 = min(d0, Point::dist2(dyn.point(i), dyn.point(j)));
+	}
+      }
+      assert(d == d0);
+      assert(d == infinity || d == Point::dist2(dyn.point(a), dyn.point(b)));
+    }
+  }
+  double seconds = (clock()-start)/(double)CLOCKS_PER_SEC;
+  cout << sqrt(d) << " " << a << " " << b;
+  if (!test && nupdates > 0) cout << " " << nupdates/seconds << " updates/s";
+  cout << "\n";
+}
+
+// Coordinates for the generic solver. The integer types get a fixed
+// point version of the value, saturating so differences don't overflow.
+template<typename T>
+T tocoord(double v)
+{
+  if (!numeric_limits<T>::is_integer) return v;
+  double limit = (sizeof(T) == 4) ? 1 << 30 : 1LL << 61;
+  return max(-limit, min(limit, v*1e6));
+}
+
+// Random points in D dimensions with the generic solver, a few of the
+// distributions from main() extended to more axes.
+template<typename T, int D>
+void rungeneric(int npoints, int type, int thresh, bool test)
+{
+  typedef Closest<T,D> Solver;
+  Solver solver(thresh);
+  vector<typename Solver::Vec> pts(npoints);
+  for (;; type++) {
+    for (int i = 0; i < npoints; i++) {
+      for (int k = 0; k < D; k++) {
+	double x = rand()/(double)RAND_MAX;
+	double v;
+	switch (type%7) {
+	case 0: v = x; break;
+	case 1: v = 1/x; break;
+	case 2: v = (k == 0) ? x : 0; break;
+	case 3: v = (k == D-1) ? x : 0; break;
+	case 4: v = i; break;
+	case 5: v = x*x; break;
+	case 6: v = (k < D/2) ? 0 : x; break;
+	default: assert(0);
+	}
+	pts[i][k] = tocoord<T>(v);
+      }
+    }
+    int a, b;
+    typename Solver::Dist d1 = solver.solve(pts.data(), npoints, &a, &b);
+    double s1 = sqrt((double)d1);
+    if (test) {
+      int a2, b2;
+      typename Solver::Dist d2 = solver.brute(pts.data(), npoints, &a2, &b2);
+      assert(d1 == d2);
+      cout << s1 << " " << sqrt((double)d2) << "\n";
+    } else {
+      cout << s1 << " " << a << " " << b << "\n";
+      break;
+    }
+  }
+}
+
+template<typename T>
+void rungeneric(int dim, int npoints, int type, int thresh, bool test)
+{
+  switch (dim) {
+  case 2: rungeneric<T,2>(npoints, type, thresh, test); break;
+  case 3: rungeneric<T,3>(npoints, type, thresh, test); break;
+  case 4: rungeneric<T,4>(npoints, type, thresh, test); break;
+  default: assert(0);
+  }
+}
+
+// Binary point files: a 16 byte header of "closest" (with its NUL)
+// and the number of points as a uint64, then the points as pairs of
+// doubles, x then y, all in the machine's byte order (so little endian
+// in practice). The points are used straight from the mapped file.
+
+struct PointFileHeader
+{
+  char magic[8];
+  uint64_t npoints;
+};
+
+static const char pointfilemagic[8] = "closest";
+
+void writepoints(const char *filename, const Point *p, size_t n)
+{
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    cerr << "Can't write " << filename << ": " << strerror(errno) << "\n";
+    exit(1);
+  }
+  PointFileHeader header;
+  memcpy(header.magic, pointfilemagic, sizeof(header.magic));
+  header.npoints = n;
+  if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+      fwrite(p, sizeof(Point), n, fp) != n || fclose(fp) != 0) {
+    cerr << "Can't write " << filename << ": " << strerror(errno) << "\n";
+    exit(1);
+  }
+}
+
+const Point *mappoints(const char *filename, size_t *n)
+{
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    cerr << "Can't read " << filename << ": " << strerror(errno) << "\n";
+    exit(1);
+  }
+  const PointFileHeader *header = NULL;
+  if ((size_t)st.st_size >= sizeof(*header)) {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) header = (const PointFileHeader *)p;
+  }
+  close(fd);
+  if (header == NULL || memcmp(header->magic, pointfilemagic, sizeof(header->magic)) != 0 ||
+      header->npoints > (st.st_size - sizeof(*header))/sizeof(Point)) {
+    cerr << filename << ": not a point file\n";
+    exit(1);
+  }
+  // We'll read it through from start to end
+  madvise((void *)header, st.st_size, MADV_SEQUENTIAL);
+  *n = header->npoints;
+  return (const Point *)(header+1);
+}
+
+// Out of core closest pair, for point sets bigger than memory: sort
+// runs of slabsize points by (x,y), merge them into one sorted
+// temporary file, then go through that a slab at a time, solving each
+// slab with Grid and checking pairs across the boundaries with the
+// strip scan from closestsoa(). The points before a boundary that
+// could be in a pair across it are kept from slab to slab (they can
+// span several narrow slabs). Only a slab and the strip need to be in
+// memory, though the strip won't be small if, say, most of the points
+// have the same x.
+
+static bool xorder(const Point &p1, const Point &p2)
+{
+  return p1.x < p2.x || (p1.x == p2.x && p1.y < p2.y);
+}
+
+static bool yorder(const Point &p1, const Point &p2)
+{
+  return p1.y < p2.y || (p1.y == p2.y && p1.x < p2.x);
+}
+
+static FILE *tempfile()
+{
+  FILE *fp = tmpfile();
+  if (fp == NULL) {
+    cerr << "Can't make temporary file: " << strerror(errno) << "\n";
+    exit(1);
+  }
+  return fp;
+}
+
+static void writeall(FILE *fp, const Point *p, size_t n)
+{
+  if (fwrite(p, sizeof(Point), n, fp) != n) {
+    cerr << "Can't write temporary file: " << strerror(errno) << "\n";
+    exit(1);
+  }
+}
+
+// Merge the sorted runs into one sorted file, reading each run in
+// blocks of the given size.
+static FILE *mergeruns(vector<FILE *> &runs, size_t blocksize)
+{
+  struct Reader { FILE *fp; vector<Point> buf; size_t pos, end; };
+  vector<Reader> readers(runs.size());
+  auto refill = [&](Reader &r) {
+    r.pos = 0;
+    r.end = fread(r.buf.data(), sizeof(Point), r.buf.size(), r.fp);
+    return r.end > 0;
+  };
+  // A min-heap of runs, on their next point
+  auto later = [&](int a, int b) { return xorder(readers[b].buf[readers[b].pos], readers[a].buf[readers[a].pos]); };
+  vector<int> heap;
+  for (size_t i = 0; i < runs.size(); i++) {
+    Reader &r = readers[i];
+    r.fp = runs[i];
+    r.buf.resize(blocksize, Point(0,0));
+    rewind(r.fp);
+    if (refill(r)) heap.push_back(i);
+  }
+  make_heap(heap.begin(), heap.end(), later);
+  FILE *out = tempfile();
+  vector<Point> outbuf;
+  outbuf.reserve(blocksize);
+  while (!heap.empty()) {
+    pop_heap(heap.begin(), heap.end(), later);
+    Reader &r = readers[heap.back()];
+    outbuf.push_back(r.buf[r.pos++]);
+    if (outbuf.size() == blocksize) {
+      writeall(out, outbuf.data(), outbuf.size());
+      outbuf.clear();
+    }
+    if (r.pos < r.end || refill(r)) push_heap(heap.begin(), heap.end(), later);
+    else heap.pop_back();
+  }
+  writeall(out, outbuf.data(), outbuf.size());
+  for (size_t i = 0; i < runs.size(); i++) fclose(runs[i]);
+  return out;
+}
+
+double closestooc(const Point *pts, size_t n, size_t slabsize)
+{
+  vector<Point> slab(slabsize, Point(0,0));
+  // Sorted runs
+  vector<FILE *> runs;
+  for (size_t start = 0; start < n; start += slabsize) {
+    size_t m = min(slabsize, n-start);
+    copy(pts+start, pts+start+m, slab.begin());
+    sort(slab.begin(), slab.begin()+m, xorder);
+    runs.push_back(tempfile());
+    writeall(runs.back(), slab.data(), m);
+  }
+  FILE *sorted;
+  if (runs.size() == 1) {
+    sorted = runs[0];
+  } else {
+    sorted = mergeruns(runs, max(slabsize/(runs.size()+1), (size_t)1024));
+  }
+  rewind(sorted);
+
+  Grid grid;
+  double dist = infinity;
+  vector<Point> tail, strip;
+  vector<double> sx, sy;
+  size_t m;
+  while ((m = fread(slab.data(), sizeof(Point), slabsize, sorted)) > 0) {
+    dist = min(dist, grid.closest(slab.data(), m));
+    double delta = sqrt(dist);
+    if (!tail.empty()) {
+      // The strip around the boundary, in y order
+      double x0 = slab[0].x;
+      strip.clear();
+      for (size_t i = 0; i < tail.size(); i++) {
+	if (tail[i].x >= x0-delta) strip.push_back(tail[i]);
+      }
+      for (size_t i = 0; i < m && slab[i].x <= x0+delta; i++) strip.push_back(slab[i]);
+      sort(strip.begin(), strip.end(), yorder);
+      sx.resize(strip.size());
+      sy.resize(strip.size());
+      for (size_t i = 0; i < strip.size(); i++) {
+	sx[i] = strip[i].x;
+	sy[i] = strip[i].y;
+      }
+      int ns = strip.size();
+      dist = stripscansoa(sx.data(), sy.data(), 0, ns, ns, dist, delta);
+      delta = sqrt(dist);
+    }
+    // What could be in a pair across the next boundary
+    double x1 = slab[m-1].x;
+    size_t keep = 0;
+    for (size_t i = 0; i < tail.size(); i++) {
+      if (tail[i].x >= x1-delta) tail[keep++] = tail[i];
+    }
+    tail.erase(tail.begin()+keep, tail.end());
+    for (size_t i = 0; i < m; i++) {
+      if (slab[i].x >= x1-delta) tail.push_back(slab[i]);
+    }
+  }
+  fclose(sorted);
+  return dist;
+}
+
+// The random point distributions, by type%ntypes
+const int ntypes = 11;
+const char *typenames[ntypes] = {
+  "x,y", "1/x,1/y", "x,0", "0,y", "1/x,0", "0,1/y", "i,0", "0,i", "i,i", "x^2,y^2", "1/x^2,1/y^2"
+};
+
+void makepoints(int type, int npoints, vector<Point> &generated)
+{
+  generated.clear();
+  for (int i = 0; i < npoints; i++) {
+    double x = rand()/(double)RAND_MAX;
+    double y = rand()/(double)RAND_MAX;
+    switch (type%ntypes) {
+    case 0:
+      generated.push_back(Point(x,y));
+      break;
+    case 1:
+      generated.push_back(Point(1/x,1/y));
+      break;
+    case 2:
+      generated.push_back(Point(x,0));
+      break;
+    case 3:
+      generated.push_back(Point(0,y));
+      break;
+    case 4:
+      generated.push_back(Point(1/x,0));
+      break;
+    case 5:
+      generated.push_back(Point(0,1/y));
+      break;
+    case 6:
+      generated.push_back(Point(i,0));
+      break;
+    case 7:
+      generated.push_back(Point(0,i));
+      break;
+    case 8:
+      generated.push_back(Point(i,i));
+      break;
+    case 9:
+      generated.push_back(Point(x*x,y*y));
+      break;
+    case 10:
+      generated.push_back(Point(1/(x*x),1/(y*y)));
+      break;
+    default:
+      assert(0);
+    }
+  }
+}
+
+// Allocations, counted only for -bench so other runs don't pay for
+// the atomic increment
+bool countallocs = false;
+atomic<long> nallocs(0);
+
+void *operator new(size_t size)
+{
+  if (countallocs) nallocs.fetch_add(1, memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) throw bad_alloc();
+  return p;
+}
+
+// GCC can't see that these go with the operator new above
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#pragma GCC diagnostic pop
+
+// The threshold for the engine stored by -bench -tune in tunefile,
+// or -1 if there isn't one
+int readtune(const char *tunefile, bool soa)
+{
+  FILE *fp = fopen(tunefile, "r");
+  if (fp == NULL) {
+    cerr << "Can't read " << tunefile << ": " << strerror(errno) << "\n";
+    exit(1);
+  }
+  int result = -1, value;
+  char key[32];
+  while (fscanf(fp, "%31s %d", key, &value) == 2) {
+    if (strcmp(key, soa ? "soathresh" : "thresh") == 0) result = value;
+  }
+  fclose(fp);
+  return result;
+}
+
+struct BenchTimes
+{
+  int64_t sort, solve, strip;
+  long allocs;
+};
+
+// Sort and solve the points (which must be distinct) with the current
+// thresh, adding the times to t. Returns the squared distance.
+double benchrun(const vector<Point> &pts, bool soa, BenchTimes &t)
+{
+  atomic<int64_t> strip(0);
+  long allocs = nallocs;
+  points = PointArray{pts.data(), pts.size()};
+  int npoints = pts.size();
+  int64_t t0 = nanos();
+  vector<int> px(npoints), py(npoints);
+  sortpoints(pts.data(), npoints, px.data(), py.data());
+  int64_t t1 = nanos();
+  stripns = &strip;
+  double dist;
+  if (soa) {
+    vector<double> coords(4*npoints), scratch(2*scratchsize(npoints));
+    double *ax = coords.data(), *ay = ax+npoints, *bx = ay+npoints, *by = bx+npoints;
+    for (int i = 0; i < npoints; i++) {
+      ax[i] = pts[px[i]].x; ay[i] = pts[px[i]].y;
+      bx[i] = pts[py[i]].x; by[i] = pts[py[i]].y;
+    }
+    dist = closestsoa(ax, ay, bx, by, npoints, scratch.data());
+  } else {
+    vector<int> scratch(scratchsize(npoints));
+    dist = closest<&Point::x, &Point::y>(px.data(), py.data(), npoints, scratch.data());
+  }
+  stripns = NULL;
+  int64_t t2 = nanos();
+  t.sort += t1-t0;
+  t.solve += t2-t1;
+  t.strip += strip;
+  t.allocs += nallocs-allocs;
+  return dist;
+}
+
+// Random points of the given type, without duplicates (so maybe a
+// few less than asked for), in random order.
+void benchpoints(int type, int npoints, vector<Point> &pts)
+{
+  makepoints(type, npoints, pts);
+  sort(pts.begin(), pts.end(), xorder);
+  pts.erase(unique(pts.begin(), pts.end(), [](const Point &p1, const Point &p2) {
+	return p1.x == p2.x && p1.y == p2.y;
+      }), pts.end());
+  shuffle(pts.begin(), pts.end(), mt19937(type));
+}
+
+// The fastest brute force threshold for uniform points on this host
+int tunethresh(int npoints, bool soa)
+{
+  static const int candidates[] = { 0, 2, 4, 8, 16, 32, 64, 128 };
+  vector<Point> pts;
+  benchpoints(0, npoints, pts);
+  int best = 0;
+  int64_t besttime = numeric_limits<int64_t>::max();
+  for (int c : candidates) {
+    thresh = c;
+    // Best of a few, to miss interruptions
+    int64_t time = numeric_limits<int64_t>::max();
+    for (int rep = 0; rep < 3; rep++) {
+      BenchTimes t = {};
+      benchrun(pts, soa, t);
+      time = min(time, t.solve);
+    }
+    if (time < besttime) {
+      best = c;
+      besttime = time;
+    }
+  }
+  return best;
+}
+
+// Time the engine on each distribution, for powers of 10 points up to
+// maxpoints. Small problems are repeated for steadier times. With
+// threads, the strip time is summed over them, so is less useful.
+// With tune, first find the best thresholds, storing them in tunefile
+// if there is one.
+void runbench(int maxpoints, bool soa, bool tune, const char *tunefile)
+{
+  countallocs = true;
+  if (tune) {
+    int n = min(maxpoints, 100000);
+    int t = tunethresh(n, false), tsoa = tunethresh(n, true);
+    thresh = soa ? tsoa : t;
+    printf("Tuned thresh %d, for -soa %d", t, tsoa);
+    if (tunefile) {
+      FILE *fp = fopen(tunefile, "w");
+      if (fp == NULL || fprintf(fp, "thresh %d\nsoathresh %d\n", t, tsoa) < 0 || fclose(fp) != 0) {
+        cerr << "Can't write " << tunefile << ": " << strerror(errno) << "\n";
+        exit(1);
+      }
+      printf(", stored in %s", tunefile);
+    }
+    printf("\n");
+  }
+  printf("%s engine, thresh %d\n", soa ? "soa" : "index", thresh);
+  printf("%-12s %9s %10s %10s %10s %9s %8s\n",
+	 "type", "n", "sort ms", "recurse ms", "strip ms", "ns/point", "allocs");
+  vector<Point> pts;
+  for (int n = min(1000, maxpoints); ; n = min(10*n, maxpoints)) {
+    for (int type = 0; type < ntypes; type++) {
+      benchpoints(type, n, pts);
+      int reps = max(1, 1000000/n);
+      BenchTimes t = {};
+      for (int rep = 0; rep < reps; rep++) benchrun(pts, soa, t);
+      double ms = 1e6*reps;
+      printf("%-12s %9zu %10.3f %10.3f %10.3f %9.1f %8ld\n",
+	     typenames[type], pts.size(), t.sort/ms, (t.solve-t.strip)/ms, t.strip/ms,
+	     (double)(t.sort+t.solve)/reps/pts.size(), t.allocs/reps);
+      fflush(stdout);
+    }
+    if (n == maxpoints) break;
+  }
+}
+
+// Random sets of 2 to maxsize points, npoints in all, solved as a
+// batch. With test, each set is checked against brute force.
+void runbatch(int npoints, int maxsize, int type, bool test)
+{
+  vector<Point> pts;
+  vector<size_t> offsets;
+  vector<PairResult> results;
+  Closest<double,2> checker;
+  vector<Closest<double,2>::Vec> vecs;
+  for (;; type++) {
+    makepoints(type, npoints, pts);
+    offsets.assign(1, 0);
+    while (offsets.back() < pts.size()) {
+      offsets.push_back(min(offsets.back() + 2 + rand()%(maxsize-1), pts.size()));
+    }
+    int nsets = offsets.size()-1;
+    results.resize(nsets);
+    int64_t start = nanos();
+    closestbatch(pts.data(), offsets.data(), nsets, results.data());
+    int64_t ns = nanos()-start;
+    double dist = infinity;
+    for (int s = 0; s < nsets; s++) dist = min(dist, results[s].dist);
+    if (test) {
+      for (int s = 0; s < nsets; s++) {
+	const Point *set = &pts[offsets[s]];
+	int size = offsets[s+1]-offsets[s];
+	vecs.resize(size);
+	for (int i = 0; i < size; i++) vecs[i] = {{ set[i].x, set[i].y }};
+	int a, b;
+	const PairResult &r = results[s];
+	assert(r.dist == checker.brute(vecs.data(), size, &a, &b));
+	assert(size < 2 || (r.a < r.b && Point::dist2(set[r.a], set[r.b]) == r.dist));
+      }
+      cout << sqrt(dist) << " " << nsets << " sets\n";
+    } else {
+      cout << sqrt(dist) << "\n";
+      cerr << nsets << " sets, " << ns/1e6 << "ms, " << (double)ns/npoints << "ns/point\n";
+      break;
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  bool test = false;
+  bool randomize = false;
+  bool printpoints = false;
+  int type = 0;
+  int nthreads = 1;
+  bool soa = false;
+  bool grid = false;
+  int nupdates = -1;
+  int kpairs = 0;
+  bool allnn = false;
+  const char *readfile = NULL;
+  const char *writefile = NULL;
+  double oocmb = 0;
+  int dim = 0;
+  bool bench = false;
+  const char *tunefile = NULL;
+  int batchmax = 0;
+  const char *coord = NULL;
+  bool threshgiven = false;
+  const char *progname = argv[0];
+  argc--; argv++;
+  while (argc > 0) {
+    if (strcmp(argv[0], "-test") == 0) {
+      test = true;
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-t") == 0) {
+      argc--; argv++;
+      thresh = atoi(argv[0]);
+      threshgiven = true;
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-j") == 0) {
+      argc--; argv++;
+      nthreads = atoi(argv[0]);
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-g") == 0) {
+      argc--; argv++;
+      grain = atoi(argv[0]);
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-type") == 0) {
+      argc--; argv++;
+      type = atoi(argv[0]);
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-r") == 0) {
+      argc--; argv++;
+      randomize = true;
+    } else if (strcmp(argv[0], "-soa") == 0) {
+      argc--; argv++;
+      soa = true;
+    } else if (strcmp(argv[0], "-grid") == 0) {
+      argc--; argv++;
+      grid = true;
+    } else if (strcmp(argv[0], "-updates") == 0) {
+      argc--; argv++;
+      nupdates = atoi(argv[0]);
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-k") == 0) {
+      argc--; argv++;
+      kpairs = atoi(argv[0]);
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-nn") == 0) {
+      argc--; argv++;
+      allnn = true;
+    } else if (strcmp(argv[0], "-read") == 0) {
+      argc--; argv++;
+      readfile = argv[0];
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-write") == 0) {
+      argc--; argv++;
+      writefile = argv[0];
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-ooc") == 0) {
+      argc--; argv++;
+      oocmb = atof(argv[0]);
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-dim") == 0) {
+      argc--; argv++;
+      dim = atoi(argv[0]);
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-coord") == 0) {
+      argc--; argv++;
+      coord = argv[0];
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-bench") == 0) {
+      argc--; argv++;
+      bench = true;
+    } else if (strcmp(argv[0], "-tune") == 0) {
+      argc--; argv++;
+      tunefile = argv[0];
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-batch") == 0) {
+      argc--; argv++;
+      batchmax = atoi(argv[0]);
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-p") == 0) {
+      argc--; argv++;
+      printpoints = true;
+    } else {
+      break;
+    }
+  }
+  bool generic = dim != 0 || coord != NULL;
+  if (dim == 0) dim = 2;
+  if (coord == NULL) coord = "double";
+  if (argc != (readfile ? 0 : 1) || nthreads < 1 || grain < 2 || oocmb < 0 ||
+      dim < 2 || dim > 4 || (generic && readfile) || batchmax < 0 || batchmax == 1 ||
+      (strcmp(coord, "float") != 0 && strcmp(coord, "double") != 0 &&
+       strcmp(coord, "int32") != 0 && strcmp(coord, "int64") != 0)) {
+    cerr << "Usage: " << progname << " [-r] [-p] [-t threshold] [-j threads] [-g grain] [-soa] [-grid]"
+	 " [-updates N] [-k K] [-nn] [-read file] [-write file] [-ooc MB]"
+	 " [-dim D] [-coord float|double|int32|int64] [-bench] [-tune file] [-batch N] [-test] npoints\n";
+    exit(1);
+  }
+
+  int npoints;
+  const Point *mapped = NULL;
+  if (readfile) {
+    size_t n;
+    mapped = mappoints(readfile, &n);
+    if (n > (size_t)numeric_limits<int>::max() && oocmb == 0) {
+      cerr << readfile << ": too many points, except for -ooc\n";
+      exit(1);
+    }
+    npoints = min(n, (size_t)numeric_limits<int>::max());
+    points = PointArray{mapped, n};
+  } else {
+    npoints = atoi(argv[0]);
+  }
+  // Each point is copied into the slab, and again for sorting the runs
+  size_t slabsize = max((size_t)(oocmb*(1<<20)/(3*sizeof(Point))), (size_t)1024);
+
+  if (randomize) srand(time(NULL));
+
+  if (nthreads > 1) pool = new Pool(nthreads);
+  // Brute force is cheap enough with SIMD to use it for bigger problems,
+  // but better still is what -bench found
+  if (!threshgiven) {
+    int tuned = (tunefile && !bench) ? readtune(tunefile, soa) : -1;
+    if (tuned >= 0) thresh = tuned;
+    else if (soa) thresh = 32;
+  }
+
+  if (bench) {
+    runbench(npoints, soa, !threshgiven, tunefile);
+    return 0;
+  }
+  if (batchmax > 0) {
+    runbatch(npoints, batchmax, type, test);
+    return 0;
+  }
+
+  if (generic) {
+    if (strcmp(coord, "float") == 0) rungeneric<float>(dim, npoints, type, thresh, test);
+    else if (strcmp(coord, "double") == 0) rungeneric<double>(dim, npoints, type, thresh, test);
+    else if (strcmp(coord, "int32") == 0) rungeneric<int32_t>(dim, npoints, type, thresh, test);
+    else rungeneric<int64_t>(dim, npoints, type, thresh, test);
+    return 0;
+  }
+
+  // Scratch space for closest(), reused for each problem. The grid
+  // keeps its own tables from one problem to the next.
+  vector<int> scratch;
+  vector<double> coords, coordscratch;
+  Grid gridengine;
+  if (oocmb > 0) {
+    grid = soa = false;
+  } else if (grid) {
+    soa = false;
+  } else if (soa) {
+    coords.resize(4*npoints);
+    coordscratch.resize(2*scratchsize(npoints));
+  } else {
+    scratch.resize(scratchsize(npoints));
+  }
+
+  while (true) {
+  restart:
+    vector<Point> generated;
+    if (readfile == NULL) makepoints(type, npoints, generated);
+    if (readfile == NULL) points = PointArray{generated.data(), generated.size()};
+    vector<int> px;
+    vector<int> py;
+    // The grid, the dynamic structure and the out of core mode don't
+    // need sorting, but -test still checks for equal points
+    bool sorted = (!grid && nupdates < 0 && oocmb == 0) || test;
+    if (sorted) {
+      px.resize(npoints);
+      py.resize(npoints);
+    }
+    if (sorted) sortpoints(points.data, npoints, px.data(), py.data());
+    for (int i = 0; sorted && i < npoints-1; i++) {
+      if (points[px[i]].x == points[px[i+1]].x &&
+	  points[px[i]].y == points[px[i+1]].y) {
+	cerr << "Equal points!\n";
+	if (readfile) exit(1);
+	goto restart;
+      }
+    }
+    type++;
+    if (writefile) writepoints(writefile, points.data, points.size());
+    if (printpoints) {
+      for (int i = 0; i < npoints; i++) {
+	cerr << points[i].x << " " << points[i].y << "\n";
       }
     }
     //cerr << "Sorted\n";
-    double s1 = sqrt(closest<&Point::x, &Point::y>(&px[0],&py[0],npoints));
+    if (nupdates >= 0) {
+      rundynamic(npoints, nupdates, test);
+      if (!test || readfile) break;
+      continue;
+    }
+    if (kpairs > 0 || allnn) {
+      runkdtree(&px[0], &py[0], npoints, kpairs, allnn, test);
+      if (!test || readfile) break;
+      continue;
+    }
+    double s1;
+    if (oocmb > 0) {
+      s1 = sqrt(closestooc(points.data, points.size(), slabsize));
+    } else if (grid) {
+      s1 = sqrt(gridengine.closest(points.data, npoints));
+    } else if (soa) {
+      // The coordinates in x order, then in y order
+      double *ax = coords.data(), *ay = ax+npoints, *bx = ay+npoints, *by = bx+npoints;
+      for (int i = 0; i < npoints; i++) {
+	ax[i] = points[px[i]].x; ay[i] = points[px[i]].y;
+	bx[i] = points[py[i]].x; by[i] = points[py[i]].y;
+      }
+      s1 = sqrt(closestsoa(ax,ay,bx,by,npoints,coordscratch.data()));
+    } else {
+      s1 = sqrt(closest<&Point::x, &Point::y>(&px[0],&py[0],npoints,scratch.data()));
+    }
     if (test) {
       double s2 = sqrt(closest0(&px[0],npoints));
       assert(s1 == s2);
       cout << s1 << " " << s2 << "\n";
+      // A file only has the one set of points to check
+      if (readfile) break;
     } else {
       cout << s1 << "\n";
       break;
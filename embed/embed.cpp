@@ -9,6 +9,8 @@
 #include <errno.h>
 #include <netinet/ip.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <vector>
 
 // Some handy macros to help with error checking
 #define CHECK(e) \
@@ -148,7 +150,10 @@ PyMODINIT_FUNC PyInit_emb() {
   return PyModule_Create(&moduledef);
 }
 
-int runinterpreter(const wchar_t *argname, int fd) {
+// Start up the interpreter on the terminal fd, then wait for a byte
+// on gofd before printing the banner and reading commands, so the
+// start up can be done before there is anyone to talk to.
+int runinterpreter(const wchar_t *argname, int fd, int gofd) {
   CHECKFD(dup2(fd,0));
   CHECKFD(dup2(fd,1));
   CHECKFD(dup2(fd,2));
@@ -159,58 +164,175 @@ int runinterpreter(const wchar_t *argname, int fd) {
   Py_Initialize();
   PyRun_SimpleString("from time import time,ctime\n");
   PyRun_SimpleString("from emb import init,func\n");
-  PyRun_SimpleString("print('Today is',ctime(time()))\n");
   PyRun_SimpleString("import readline\n");
+  char go;
+  ssize_t nread = read(gofd,&go,1);
+  CHECK(nread >= 0);
+  // Our forwarder went without a connection for us
+  if (nread == 0) exit(0);
+  CHECKSYS(close(gofd));
+  PyRun_SimpleString("print('Today is',ctime(time()))\n");
   PyRun_InteractiveLoop(stdin, "-");
   Py_Finalize();
   return 0;
 }
 
-int main(int argc, char *argv[])
+// Send a file descriptor over a unix socket.
+bool sendfd(int sock, int fd)
 {
-  int port = -1;
-  if (argc > 1) {
-    port = atoi(argv[1]);
+  char byte = 0;
+  iovec iov = { &byte, 1 };
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control,0,sizeof(control));
+  msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg),&fd,sizeof(int));
+  return sendmsg(sock,&msg,MSG_NOSIGNAL) == 1;
+}
+
+// Receive a file descriptor sent with sendfd, or -1 if the other
+// end has gone away.
+int recvfd(int sock)
+{
+  char byte;
+  iovec iov = { &byte, 1 };
+  char control[CMSG_SPACE(sizeof(int))];
+  msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t nread = recvmsg(sock,&msg,0);
+  CHECK(nread >= 0);
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (nread == 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+  int fd;
+  memcpy(&fd,CMSG_DATA(cmsg),sizeof(int));
+  return fd;
+}
+
+// Start a worker, ready for a connection: it makes a pty and starts
+// an interpreter on it, then waits for the server to send it a
+// connected socket. Returns the server's end of the socket pair to
+// send it on. The worker doesn't need the server socket or the
+// other workers' sockets, so those are closed.
+int startworker(int serversock, const std::vector<int> &workers)
+{
+  int sv[2];
+  CHECKSYS(socketpair(AF_UNIX,SOCK_SEQPACKET,0,sv));
+  if (fork() != 0) {
+    // Server side
+    CHECKSYS(close(sv[1]));
+    return sv[0];
+  }
+  CHECKSYS(close(sv[0]));
+  CHECKSYS(close(serversock));
+  for (size_t i = 0; i < workers.size(); i++) CHECKSYS(close(workers[i]));
+  // Create a pseudo-terminal
+  int mpty = posix_openpt(O_RDWR);
+  CHECKFD(mpty);
+  CHECKSYS(grantpt(mpty)); // pty magic
+  CHECKSYS(unlockpt(mpty));
+  // Start our own session
+  CHECK(setsid()>0); 
+  int spty = open(ptsname(mpty),O_RDWR);
+  // spty is now our controlling terminal
+  CHECKFD(spty);
+  int go[2];
+  CHECKSYS(pipe(go));
+  // Now split into two processes, one copying data
+  // between socket and pty; the other running the
+  // actual interpreter.
+  if (fork() != 0) {
+    CHECKSYS(close(spty));
+    CHECKSYS(close(go[0]));
+    // Ignore sigint here
+    setsignal(SIGINT, SIG_IGN);
+    int sockfd = recvfd(sv[1]);
+    // No connection, the server has gone
+    if (sockfd < 0) exit(0);
+    CHECKSYS(close(sv[1]));
+    CHECK(write(go[1],"",1) == 1);
+    CHECKSYS(close(go[1]));
+    exit(runforwarder(sockfd,mpty));
   } else {
-    fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    CHECKSYS(close(sv[1]));
+    CHECKSYS(close(mpty)); 
+    CHECKSYS(close(go[1]));
+    // Default sigint here - will be replaced by interpreter
+    setsignal(SIGINT, SIG_DFL);
+    exit(runinterpreter(L"embed",spty,go[0]));
+  }
+}
+
+// Usage: embed [--pool N] [--refill N] <port>
+//  --pool: interpreters to keep started up, waiting for connections,
+//   default 4. With 0, each one is started when its connection comes in.
+//  --refill: start new interpreters when this many of the pool have
+//   been used, default 1 (replace each one straight away). Must be no
+//   more than --pool.
+int main(int argc, char *argv[])
+{
+  const char *progname = argv[0];
+  const char *usage = "Usage: %s [--pool N] [--refill N] <port>\n";
+  int poolsize = 4;
+  int refill = 1;
+  argc--; argv++;
+  while (argc > 0 && argv[0][0] == '-') {
+    if (strcmp(argv[0],"--pool") == 0 && argc > 1) {
+      argc--; argv++;
+      poolsize = atoi(argv[0]);
+    } else if (strcmp(argv[0],"--refill") == 0 && argc > 1) {
+      argc--; argv++;
+      refill = atoi(argv[0]);
+    } else {
+      fprintf(stderr, usage, progname);
+      exit(0);
+    }
+    argc--; argv++;
+  }
+  if (argc != 1 || poolsize < 0 || refill < 1) {
+    fprintf(stderr, usage, progname);
+    exit(0);
+  }
+  if (poolsize > 0 && refill > poolsize) {
+    fprintf(stderr, "%s: --refill can be at most --pool (%d)\n",
+            progname, poolsize);
     exit(0);
   }
+  int port = atoi(argv[0]);
   setsignal(SIGCHLD, SIG_IGN);
   int serversock = makeserversock(port);
+  // The server ends of the waiting workers' sockets, oldest first
+  std::vector<int> workers;
   while (true) {
+    if ((int)workers.size() <= poolsize-refill) {
+      while ((int)workers.size() < poolsize) {
+        workers.push_back(startworker(serversock,workers));
+      }
+    }
     int sockfd = accept(serversock,NULL,NULL);
     CHECKFD(sockfd);
-    if (fork() != 0) {
-      // Server side, close new connection and continue
-      CHECKSYS(close(sockfd));
-    } else {
-      // Client side, close server socket
-      CHECKSYS(close(serversock)); serversock = -1;
-       // Create a pseudo-terminal
-      int mpty = posix_openpt(O_RDWR);
-      CHECKFD(mpty);
-      CHECKSYS(grantpt(mpty)); // pty magic
-      CHECKSYS(unlockpt(mpty));
-      // Start our own session
-      CHECK(setsid()>0); 
-      int spty = open(ptsname(mpty),O_RDWR);
-      // spty is now our controlling terminal
-      CHECKFD(spty);
-      // Now split into two processes, one copying data
-      // between socket and pty; the other running the
-      // actual interpreter.
-      if (fork() != 0) {
-        CHECKSYS(close(spty));
-        // Ignore sigint here
-        setsignal(SIGINT, SIG_IGN);
-        return runforwarder(sockfd,mpty);
-      } else {
-        CHECKSYS(close(sockfd));
-        CHECKSYS(close(mpty)); 
-        // Default sigint here - will be replaced by interpreter
-        setsignal(SIGINT, SIG_DFL);
-        return runinterpreter(L"embed",spty);
-      }
+    // Hand over to the oldest worker, which is most likely to be
+    // ready. One that has died is dropped, and if there are none
+    // left, start one now.
+    while (true) {
+      if (workers.empty()) workers.push_back(startworker(serversock,workers));
+      int worker = workers.front();
+      workers.erase(workers.begin());
+      bool sent = sendfd(worker,sockfd);
+      CHECKSYS(close(worker));
+      if (sent) break;
     }
+    CHECKSYS(close(sockfd));
   }
 }
@@ -0,0 +1,384 @@
+// Offline benchmark for the reflect packet path.
+// Loads packets from a pcap file, or makes a synthetic mix, then runs
+// them through reflect()/reflecttap() (and so doarp()) in a tight
+// loop, reporting packets/s, ns/packet and a latency histogram for
+// each kind of packet. No device or capabilities needed.
+//
+// Usage: bench [--v] [--tap] [--iterations N] [--size N] [--policy <file>] [--flows N]
+//              [--rewrite <prefix>] [--verify] [<file.pcap>]
+//  --tap: synthetic packets are ethernet frames (with some ARP)
+//  --iterations: number of passes over the packets, default 1000
+//  --size: size of synthetic IP packets, default 64
+//  --policy: policy file, as for reflect
+//  --flows: track flows in a table of this size first, as for reflect
+//  --rewrite, --verify: rewrite sources and check checksums, as for reflect
+//  <file.pcap>: ethernet (tap) or raw IP (tun) captures
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <vector>
+
+#include "packet.h"
+#include "flow.h"
+
+using namespace std;
+
+// Latency histogram buckets are powers of 2 nanoseconds
+#define NBUCKETS 24
+
+// Packets of one class, stored end to end in one buffer so the
+// benchmark loop walks through memory in order.
+struct PacketSet
+{
+  vector<uint8_t> data;
+  vector<uint32_t> offset;
+  vector<uint32_t> length;
+  void add(const uint8_t *p, size_t nbytes) {
+    offset.push_back(data.size());
+    length.push_back(nbytes);
+    data.insert(data.end(), p, p+nbytes);
+  }
+  size_t size() const { return offset.size(); }
+};
+
+static inline uint64_t now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// Standard internet checksum arithmetic, for making valid packets
+static uint32_t sum16(const uint8_t *p, size_t nbytes, uint32_t sum)
+{
+  for (size_t i = 0; i+1 < nbytes; i += 2) sum += (p[i] << 8) | p[i+1];
+  if (nbytes & 1) sum += p[nbytes-1] << 8;
+  return sum;
+}
+
+static uint16_t fold(uint32_t sum)
+{
+  while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum;
+}
+
+// Fill in a transport header of the given protocol, plus payload,
+// with the transport checksum computed over the given pseudo-header sum.
+static void maketransport(uint8_t *p, int proto, size_t nbytes, uint32_t pseudo)
+{
+  memset(p, 0, nbytes);
+  for (size_t i = 0; i < nbytes; i++) p[i] = i;
+  int csumoffset;
+  if (proto == PROTO_TCP) {
+    put16(p+0, htons(10000 + rand()%10000));
+    put16(p+2, htons(80));
+    put32(p+4, htonl(rand()));
+    put32(p+8, 0);
+    p[12] = 5 << 4;  // Data offset
+    p[13] = 0x18;    // ACK|PSH
+    put16(p+14, htons(65535));
+    put16(p+18, 0);
+    csumoffset = 16;
+  } else if (proto == PROTO_UDP) {
+    put16(p+0, htons(10000 + rand()%10000));
+    put16(p+2, htons(53));
+    put16(p+4, htons(nbytes));
+    csumoffset = 6;
+  } else {
+    // ICMP or ICMPv6 echo request
+    p[0] = (proto == PROTO_ICMP6) ? 128 : 8;
+    p[1] = 0;
+    put32(p+4, htonl(rand()));
+    csumoffset = 2;
+    if (proto == PROTO_ICMP) pseudo = 0; // No pseudo-header for ICMPv4
+  }
+  put16(p+csumoffset, 0);
+  put16(p+csumoffset, htons(fold(sum16(p, nbytes, pseudo))));
+}
+
+// Make an IPv4 packet of the given total size
+static size_t makeip4(uint8_t *p, int proto, size_t nbytes)
+{
+  uint32_t src = htonl(0x0a000000 | (rand() & 0xffffff));
+  uint32_t dst = htonl(0x0a000000 | (rand() & 0xffffff));
+  memset(p, 0, 20);
+  p[0] = 0x45;
+  put16(p+2, htons(nbytes));
+  put16(p+4, htons(rand()));
+  p[8] = 64;
+  p[PROTO_OFFSET] = proto;
+  put32(p+SRC_OFFSET4, src);
+  put32(p+DST_OFFSET4, dst);
+  put16(p+10, htons(fold(sum16(p, 20, 0))));
+  uint32_t pseudo = sum16(p+SRC_OFFSET4, 8, proto + (nbytes-20));
+  maketransport(p+20, proto, nbytes-20, pseudo);
+  return nbytes;
+}
+
+// Make an IPv6 packet of the given total size
+static size_t makeip6(uint8_t *p, int proto, size_t nbytes)
+{
+  memset(p, 0, 40);
+  p[0] = 0x60;
+  put16(p+4, htons(nbytes-40));
+  p[6] = proto;
+  p[7] = 64;
+  // fd00::/8 unique local addresses
+  for (int i = 0; i < 16; i++) {
+    p[SRC_OFFSET6+i] = rand();
+    p[DST_OFFSET6+i] = rand();
+  }
+  p[SRC_OFFSET6] = p[DST_OFFSET6] = 0xfd;
+  uint32_t pseudo = sum16(p+SRC_OFFSET6, 32, proto + (nbytes-40));
+  maketransport(p+40, proto, nbytes-40, pseudo);
+  return nbytes;
+}
+
+// Prepend an ethernet header, the packet must have space for it
+static size_t makeether(uint8_t *p, uint16_t etype, size_t nbytes)
+{
+  static const uint8_t dst[6] = { 0x02, 0x00, 0x0a, 0x00, 0x00, 0x02 };
+  static const uint8_t src[6] = { 0x02, 0x00, 0x0a, 0x00, 0x00, 0x01 };
+  memcpy(p, dst, 6);
+  memcpy(p+6, src, 6);
+  put16(p+12, htons(etype));
+  return nbytes+14;
+}
+
+static size_t makearp(uint8_t *p)
+{
+  uint8_t *arp = p+14;
+  put16(arp+0, htons(1));      // Ethernet
+  put16(arp+2, htons(0x0800)); // IPv4
+  arp[4] = 6; arp[5] = 4;
+  put16(arp+6, htons(1));      // Request
+  memcpy(arp+8, p+6, 6);       // Sender MAC
+  put32(arp+14, htonl(0x0a000001));
+  memset(arp+18, 0, 6);
+  put32(arp+24, htonl(0x0a000000 | (rand() & 0xffffff)));
+  makeether(p, 0x0806, 28);
+  memset(p, 0xff, 6);          // Broadcast
+  return 14+28;
+}
+
+void synthesize(PacketSet sets[], bool tap, size_t size, int count)
+{
+  static const int protos[] = { PROTO_TCP, PROTO_UDP, PROTO_ICMP };
+  uint8_t buf[2048];
+  size_t hdr = tap ? 14 : 0;
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < 3; j++) {
+      size_t n = makeip4(buf+hdr, protos[j], size < 48 ? 48 : size);
+      if (tap) n = makeether(buf, 0x0800, n);
+      sets[classify(buf,n,tap)].add(buf,n);
+      int proto6 = (protos[j] == PROTO_ICMP) ? PROTO_ICMP6 : protos[j];
+      n = makeip6(buf+hdr, proto6, size < 68 ? 68 : size);
+      if (tap) n = makeether(buf, 0x86dd, n);
+      sets[classify(buf,n,tap)].add(buf,n);
+    }
+    if (tap) {
+      size_t n = makearp(buf);
+      sets[CLASS_ARP].add(buf,n);
+    }
+  }
+}
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+
+// Load a classic pcap file into memory. Returns true for ethernet
+// captures (to be run through reflecttap), false for raw IP.
+bool loadpcap(const char *filename, PacketSet sets[])
+{
+  FILE *fp = fopen(filename, "rb");
+  CHECK(fp != NULL);
+  uint8_t hdr[24];
+  CHECK(fread(hdr, sizeof(hdr), 1, fp) == 1);
+  uint32_t magic = get32(hdr);
+  bool swapped;
+  if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+    swapped = false;
+  } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+    swapped = true;
+  } else {
+    fprintf(stderr, "%s: not a pcap file\n", filename);
+    exit(0);
+  }
+  #define PCAP32(x) (swapped ? __builtin_bswap32(x) : (x))
+  uint32_t linktype = PCAP32(get32(hdr+20)) & 0xffff;
+  bool tap;
+  if (linktype == LINKTYPE_ETHERNET) {
+    tap = true;
+  } else if (linktype == LINKTYPE_RAW || linktype == LINKTYPE_IPV4 ||
+             linktype == LINKTYPE_IPV6) {
+    tap = false;
+  } else {
+    fprintf(stderr, "%s: unsupported link type %u\n", filename, linktype);
+    exit(0);
+  }
+  uint8_t rec[16];
+  vector<uint8_t> buf;
+  while (fread(rec, sizeof(rec), 1, fp) == 1) {
+    uint32_t caplen = PCAP32(get32(rec+8));
+    CHECK(caplen <= 262144);
+    buf.resize(caplen);
+    CHECK(fread(buf.data(), 1, caplen, fp) == caplen);
+    if (caplen == 0) continue;
+    sets[classify(buf.data(),caplen,tap)].add(buf.data(),caplen);
+  }
+  #undef PCAP32
+  fclose(fp);
+  return tap;
+}
+
+// With --flows, the flow table. Its clock just counts packets.
+static FlowTable *flowtable = NULL;
+static uint64_t flowclock = 0;
+
+static inline bool run(uint8_t *p, size_t nbytes, bool tap)
+{
+  static const char *dev = "bench";
+  if (flowtable != NULL) {
+    FlowKey key;
+    uint8_t tcpflags;
+    if (flowkey(p,nbytes,tap,&key,&tcpflags)) {
+      flowtable->update(key,nbytes,tcpflags,flowclock);
+    }
+    flowtable->age(flowclock++);
+  }
+  if (tap) return reflecttap(p,nbytes,dev);
+  else return reflect(p,nbytes,dev);
+}
+
+// Reflecting is its own inverse, so we can run over the same packets
+// repeatedly without restoring them (and for ARP it alternates
+// between two states, doing the same work each time).
+void benchmark(const char *name, PacketSet &set, bool tap, int iterations)
+{
+  size_t count = set.size();
+  if (count == 0) return;
+  uint8_t *data = set.data.data();
+  const uint32_t *offset = set.offset.data();
+  const uint32_t *length = set.length.data();
+
+  // Warm up, and count what gets reflected
+  size_t nreflected = 0;
+  for (size_t i = 0; i < count; i++) {
+    nreflected += run(data+offset[i], length[i], tap);
+  }
+
+  uint64_t start = now();
+  for (int n = 0; n < iterations; n++) {
+    for (size_t i = 0; i < count; i++) {
+      run(data+offset[i], length[i], tap);
+    }
+  }
+  uint64_t elapsed = now() - start;
+  double npackets = (double)count*iterations;
+  double nsperpacket = elapsed/npackets;
+
+  // Now time packets individually for the latency histogram.
+  // This includes the overhead of reading the clock.
+  uint64_t hist[NBUCKETS] = {};
+  uint64_t maxns = 0;
+  int latencyiterations = iterations < 10 ? iterations : 10;
+  for (int n = 0; n < latencyiterations; n++) {
+    for (size_t i = 0; i < count; i++) {
+      uint64_t t0 = now();
+      run(data+offset[i], length[i], tap);
+      uint64_t ns = now() - t0;
+      int bucket = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+      if (bucket >= NBUCKETS) bucket = NBUCKETS-1;
+      hist[bucket]++;
+      if (ns > maxns) maxns = ns;
+    }
+  }
+  printf("%-6s %8zu %9zu %10.2f %8.1f %8lu\n",
+         name, count, nreflected, 1e3/nsperpacket, nsperpacket, maxns);
+  printf("      ");
+  for (int i = 0; i < NBUCKETS; i++) {
+    if (hist[i] > 0) printf(" <%luns:%lu", 1UL << i, hist[i]);
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *progname = argv[0];
+  const char *usage =
+    "Usage: %s [--v] [--tap] [--iterations N] [--size N] [--policy <file>]"
+    " [--flows N] [--rewrite <prefix>] [--verify] [<file.pcap>]\n";
+  bool tap = false;
+  int iterations = 1000;
+  int size = 64;
+  const char *policyfile = NULL;
+  int maxflows = 0;
+  argc--; argv++;
+  while (argc > 0 && argv[0][0] == '-') {
+    if (strcmp(argv[0],"--v") == 0) {
+      verbosity++;
+    } else if (strcmp(argv[0],"--tap") == 0) {
+      tap = true;
+    } else if (strcmp(argv[0],"--iterations") == 0 && argc > 1) {
+      argc--; argv++;
+      iterations = atoi(argv[0]);
+    } else if (strcmp(argv[0],"--size") == 0 && argc > 1) {
+      argc--; argv++;
+      size = atoi(argv[0]);
+    } else if (strcmp(argv[0],"--policy") == 0 && argc > 1) {
+      argc--; argv++;
+      policyfile = argv[0];
+    } else if (strcmp(argv[0],"--rewrite") == 0 && argc > 1) {
+      argc--; argv++;
+      if (!setrewrite(argv[0])) {
+        fprintf(stderr, "%s: bad --rewrite prefix %s\n", progname, argv[0]);
+        exit(0);
+      }
+    } else if (strcmp(argv[0],"--verify") == 0) {
+      verifycsum = true;
+    } else if (strcmp(argv[0],"--flows") == 0 && argc > 1) {
+      argc--; argv++;
+      maxflows = atoi(argv[0]);
+    } else {
+      fprintf(stderr, usage, progname);
+      exit(0);
+    }
+    argc--; argv++;
+  }
+  if (argc > 1 || iterations < 1 || size < 1 || size > 1500 || maxflows < 0) {
+    fprintf(stderr, usage, progname);
+    exit(0);
+  }
+
+  trace = verbosity;
+  loadpolicy(policyfile);
+  // Nothing ages out in the middle of a run
+  if (maxflows > 0) flowtable = new FlowTable(maxflows,UINT64_MAX);
+
+  PacketSet sets[NCLASSES];
+  if (argc > 0) {
+    tap = loadpcap(argv[0], sets);
+  } else {
+    synthesize(sets, tap, size, 1024);
+  }
+
+  // Time the clock itself, for reference
+  uint64_t t0 = now();
+  for (int i = 0; i < 1000000; i++) now();
+  uint64_t clockns = (now() - t0)/1000000;
+
+  printf("%s mode, %d iterations, clock overhead %luns\n",
+         tap ? "tap" : "tun", iterations, clockns);
+  printf("%-6s %8s %9s %10s %8s %8s\n",
+         "class", "packets", "reflected", "Mpkts/s", "ns/pkt", "max ns");
+  for (int i = 0; i < NCLASSES; i++) {
+    benchmark(classnames[i], sets[i], tap, iterations);
+  }
+}
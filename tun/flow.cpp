@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "packet.h"
+#include "flow.h"
+
+bool flowkey(uint8_t *p, size_t nbytes, bool tap, FlowKey *key, uint8_t *tcpflags)
+{
+  memset(key, 0, sizeof(*key));
+  *tcpflags = 0;
+  if (tap) {
+    if (nbytes < 14) return false;
+    p += 14; nbytes -= 14;
+  }
+  if (nbytes < 1) return false;
+  size_t hlen;
+  bool fragment = false;
+  key->version = p[0] >> 4;
+  if (key->version == 4) {
+    if (nbytes < 20) return false;
+    hlen = 4*(p[HLEN_OFFSET]&0x0f);
+    key->proto = p[PROTO_OFFSET];
+    memcpy(key->src, p+SRC_OFFSET4, 4);
+    memcpy(key->dst, p+DST_OFFSET4, 4);
+    // Only the first fragment has the ports
+    fragment = (ntohs(get16(p+6)) & 0x1fff) != 0;
+  } else if (key->version == 6) {
+    if (nbytes < 40) return false;
+    hlen = 40;
+    // Next header, ignoring any extension headers
+    key->proto = p[6];
+    memcpy(key->src, p+SRC_OFFSET6, 16);
+    memcpy(key->dst, p+DST_OFFSET6, 16);
+  } else {
+    return false;
+  }
+  if (fragment) return true;
+  if (key->proto == PROTO_TCP || key->proto == PROTO_UDP) {
+    if (nbytes < hlen+4) return true;
+    key->sport = get16(p+hlen);
+    key->dport = get16(p+hlen+2);
+  }
+  if (key->proto == PROTO_TCP && nbytes >= hlen+14) {
+    *tcpflags = p[hlen+13];
+  }
+  return true;
+}
+
+static inline uint64_t mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t flowhash(const FlowKey &key)
+{
+  uint64_t w[sizeof(FlowKey)/8];
+  memcpy(w, &key, sizeof(w));
+  // Independent multiplies, so they can all be in flight at once
+  static const uint64_t k[sizeof(FlowKey)/8] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL,
+    0xd6e8feb86659fd93ULL, 0xff51afd7ed558ccdULL,
+  };
+  uint64_t h = 0;
+  for (size_t i = 0; i < sizeof(w)/8; i++) h ^= w[i]*k[i];
+  return mix(h);
+}
+
+static inline bool sameflow(const FlowKey &k1, const FlowKey &k2)
+{
+  uint64_t w1[sizeof(FlowKey)/8], w2[sizeof(FlowKey)/8];
+  memcpy(w1, &k1, sizeof(w1));
+  memcpy(w2, &k2, sizeof(w2));
+  uint64_t diff = 0;
+  for (size_t i = 0; i < sizeof(w1)/8; i++) diff |= w1[i] ^ w2[i];
+  return diff == 0;
+}
+
+// Mask of the slots in a bucket with the given tag: bit 2*i is set
+// for a match in slot i (that's what the SSE2 compare gives us).
+static inline unsigned matchtags(const uint16_t *tags, uint16_t tag)
+{
+#if defined __SSE2__
+  __m128i t = _mm_loadu_si128((const __m128i *)tags);
+  return _mm_movemask_epi8(_mm_cmpeq_epi16(t, _mm_set1_epi16(tag))) & 0x5555;
+#else
+  unsigned m = 0;
+  for (int i = 0; i < FLOW_BUCKETSIZE; i++) {
+    if (tags[i] == tag) m |= 1 << 2*i;
+  }
+  return m;
+#endif
+}
+
+FlowTable::FlowTable(size_t maxflows, uint64_t timeout, uint64_t interval, uint64_t burst)
+  : nbuckets(1), timeout(timeout), interval(interval),
+    tolerance((burst > 0) ? (burst-1)*interval : 0),
+    cursor(0), nflows(0), evicted(0)
+{
+  while (nbuckets*FLOW_BUCKETSIZE < maxflows) nbuckets *= 2;
+  tags.assign(nbuckets*FLOW_BUCKETSIZE, 0);
+  flows.resize(nbuckets*FLOW_BUCKETSIZE);
+}
+
+Flow *FlowTable::find(const FlowKey &key, uint64_t hash, uint64_t now)
+{
+  size_t mask = nbuckets-1;
+  size_t home = hash & mask;
+  uint16_t tag = hash >> 48;
+  if (tag == 0) tag = 1;
+  for (int i = 0; i < FLOW_PROBES; i++) {
+    size_t base = ((home+i) & mask)*FLOW_BUCKETSIZE;
+    for (unsigned m = matchtags(&tags[base], tag); m != 0; m &= m-1) {
+      Flow *f = &flows[base + __builtin_ctz(m)/2];
+      if (sameflow(f->key, key)) return f;
+    }
+  }
+  // A new flow, in the first free slot or else in place of the
+  // least recently seen one.
+  size_t slot = SIZE_MAX;
+  for (int i = 0; i < FLOW_PROBES && slot == SIZE_MAX; i++) {
+    size_t base = ((home+i) & mask)*FLOW_BUCKETSIZE;
+    unsigned m = matchtags(&tags[base], 0);
+    if (m != 0) slot = base + __builtin_ctz(m)/2;
+  }
+  if (slot == SIZE_MAX) {
+    for (int i = 0; i < FLOW_PROBES; i++) {
+      size_t base = ((home+i) & mask)*FLOW_BUCKETSIZE;
+      for (size_t j = base; j < base+FLOW_BUCKETSIZE; j++) {
+        if (slot == SIZE_MAX || flows[j].last < flows[slot].last) slot = j;
+      }
+    }
+    evicted++;
+  } else {
+    nflows++;
+  }
+  tags[slot] = tag;
+  Flow *f = &flows[slot];
+  memset(f, 0, sizeof(*f));
+  f->key = key;
+  f->first = now;
+  f->tat = now;
+  return f;
+}
+
+bool FlowTable::update(const FlowKey &key, size_t nbytes, uint8_t tcpflags, uint64_t now)
+{
+  Flow *f = find(key, flowhash(key), now);
+  f->packets++;
+  f->bytes += nbytes;
+  f->last = now;
+  if (key.proto == PROTO_TCP) {
+    f->tcpflags |= tcpflags;
+    f->tcphistory = (f->tcphistory << 8) | tcpflags;
+  }
+  if (interval == 0) return true;
+  // The generic cell rate algorithm: a packet is allowed unless it
+  // is more than the burst tolerance ahead of schedule.
+  if (f->tat > now + tolerance) return false;
+  f->tat = std::max(f->tat, now) + interval;
+  return true;
+}
+
+void FlowTable::age(uint64_t now)
+{
+  size_t base = cursor*FLOW_BUCKETSIZE;
+  for (size_t i = base; i < base+FLOW_BUCKETSIZE; i++) {
+    if (tags[i] != 0 && now - flows[i].last > timeout) {
+      tags[i] = 0;
+      nflows--;
+    }
+  }
+  cursor = (cursor+1) & (nbuckets-1);
+}
+
+static void printflags(char *s, uint8_t flags)
+{
+  const char *names = "FSRPAUEC";
+  for (int i = 0; i < 8; i++) {
+    if (flags & (1 << i)) *s++ = names[i];
+  }
+  if (flags == 0) *s++ = '.';
+  *s = 0;
+}
+
+static const char *protoname(int proto)
+{
+  switch (proto) {
+  case PROTO_TCP: return "tcp";
+  case PROTO_UDP: return "udp";
+  case PROTO_ICMP: return "icmp";
+  case PROTO_ICMP6: return "icmp6";
+  default: return NULL;
+  }
+}
+
+static bool morebytes(const Flow *f1, const Flow *f2)
+{
+  return f1->bytes > f2->bytes;
+}
+
+void FlowTable::print(int maxflows, uint64_t now, double ticksperus) const
+{
+  std::vector<const Flow *> active;
+  for (size_t i = 0; i < flows.size(); i++) {
+    if (tags[i] != 0) active.push_back(&flows[i]);
+  }
+  size_t n = std::min(active.size(), (size_t)maxflows);
+  std::partial_sort(active.begin(), active.begin()+n, active.end(), morebytes);
+  printf("%zu flows, %lu evicted\n", nflows, evicted);
+  for (size_t i = 0; i < n; i++) {
+    const Flow *f = active[i];
+    const FlowKey &key = f->key;
+    int family = (key.version == 4) ? AF_INET : AF_INET6;
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    inet_ntop(family, key.src, src, sizeof(src));
+    inet_ntop(family, key.dst, dst, sizeof(dst));
+    const char *name = protoname(key.proto);
+    char proto[8];
+    if (name == NULL) snprintf(proto, sizeof(proto), "%d", key.proto);
+    printf("%-5s %s", name ? name : proto, src);
+    if (key.sport || key.dport) printf(":%u", ntohs(key.sport));
+    printf(" > %s", dst);
+    if (key.sport || key.dport) printf(":%u", ntohs(key.dport));
+    printf(" packets=%lu bytes=%lu duration=%.3fs idle=%.3fs",
+           f->packets, f->bytes, (f->last-f->first)/ticksperus/1e6,
+           (now-f->last)/ticksperus/1e6);
+    if (key.proto == PROTO_TCP) {
+      char flags[9];
+      printflags(flags, f->tcpflags);
+      printf(" flags=%s history=", flags);
+      for (int j = std::min<uint64_t>(f->packets,4)-1; j >= 0; j--) {
+        printflags(flags, f->tcphistory >> 8*j);
+        printf("%s%s", flags, j > 0 ? "," : "");
+      }
+    }
+    printf("\n");
+  }
+}
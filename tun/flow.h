@@ -0,0 +1,81 @@
+// Per-flow accounting for reflect.
+//
+// An open addressing hash table keyed on the 5-tuple. Slots are
+// grouped in buckets of 8, with a 16 bit tag for each slot kept
+// together so one SSE2 compare finds the candidates in a bucket, and
+// only those have their full keys checked. A flow that doesn't fit in
+// its home bucket goes in the next one; if both are full the least
+// recently seen flow there is evicted. Idle flows are aged out a
+// bucket at a time as packets go through, so there is no allocation
+// or sweeping in the packet loop.
+//
+// Times are in statclock() ticks. Each table is owned by one thread.
+
+#if !defined FLOW_H
+#define FLOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define FLOW_BUCKETSIZE 8
+#define FLOW_PROBES 2
+
+// IPv4 addresses are stored in the first 4 bytes, with the rest zero
+struct FlowKey
+{
+  uint8_t src[16];
+  uint8_t dst[16];
+  uint16_t sport; // Network byte order, zero if not TCP or UDP
+  uint16_t dport;
+  uint8_t proto;
+  uint8_t version; // 4 or 6
+  uint16_t pad; // Always zero, so keys can be compared a word at a time
+};
+
+struct Flow
+{
+  FlowKey key;
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t first; // Time first and last seen
+  uint64_t last;
+  uint64_t tat; // Rate limiting: when the next packet is due
+  uint32_t tcphistory; // Flags of the last 4 TCP packets, newest lowest
+  uint8_t tcpflags; // Every TCP flag seen
+};
+
+// Extract the key for a packet (or ethernet frame, if tap is true),
+// with the TCP flags or 0. Returns false if it isn't IP.
+bool flowkey(uint8_t *p, size_t nbytes, bool tap, FlowKey *key, uint8_t *tcpflags);
+
+struct FlowTable
+{
+  // Room for (at least) nflows flows. Flows not seen for timeout ticks
+  // are aged out. With interval non-zero, each flow is limited to a
+  // packet every interval ticks, with bursts of up to burst packets.
+  FlowTable(size_t nflows, uint64_t timeout, uint64_t interval = 0, uint64_t burst = 1);
+
+  // Account for a packet, creating its flow if needed. Returns false
+  // if the flow is over its rate limit.
+  bool update(const FlowKey &key, size_t nbytes, uint8_t tcpflags, uint64_t now);
+  // Age out the flows in the next bucket.
+  void age(uint64_t now);
+  // Print the flows with the most bytes.
+  void print(int maxflows, uint64_t now, double ticksperus) const;
+
+  size_t nbuckets; // A power of 2
+  uint64_t timeout;
+  uint64_t interval;
+  uint64_t tolerance; // Rate limiting burst, in ticks
+  size_t cursor; // Next bucket to age
+  size_t nflows; // In use
+  uint64_t evicted; // Flows pushed out by new ones
+  std::vector<uint16_t> tags; // Zero for an empty slot
+  std::vector<Flow> flows;
+
+private:
+  Flow *find(const FlowKey &key, uint64_t hash, uint64_t now);
+};
+
+#endif
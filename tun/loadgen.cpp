@@ -0,0 +1,385 @@
+// Load generator and round trip latency meter for reflect.
+//
+// Writes timestamped UDP or TCP packets into a tun device at a given
+// rate, addressed so the kernel forwards them on to a device served
+// by reflect. reflect sends them back, the kernel forwards them back
+// to our device, and we match them up by sequence number to get the
+// loss and the round trip times.
+//
+// For example, with persistent devices (so they can be set up first):
+//  ip tuntap add dev lg0 mode tun; ip tuntap add dev rf0 mode tun
+//  ip addr add 10.1.0.1/24 dev lg0; ip addr add 10.0.0.1/24 dev rf0
+//  ip link set lg0 up; ip link set rf0 up
+//  sysctl -w net.ipv4.ip_forward=1 net.ipv4.conf.all.rp_filter=0
+//  ./reflect rf0 &
+//  ./loadgen --rate 100000 --duration 5 lg0
+//
+// Usage: loadgen [--v] [--proto udp|tcp] [--src <addr>] [--dst <addr>] [--size N]
+//                [--rate PPS] [--duration S] [--count N] [--flows N] [--wait S] <devname>
+//  --proto: the transport protocol, default udp
+//  --src, --dst: IPv4 or IPv6 addresses, default 10.1.0.2 and 10.0.0.2
+//  --size: IP packet size, default 64 or the smallest that fits
+//  --rate: packets per second, default 0 for as fast as possible
+//  --duration, --count: when to stop sending, default 1 second
+//  --flows: number of different source ports to use, default 1
+//  --wait: time to wait for stragglers after sending, default 1 second.
+//   Replies that took longer than this, or claim to have been sent in
+//   the future, are ignored (so counted as lost).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include <algorithm>
+
+#include "packet.h"
+
+// The payload starts with this, so we can pick out our own packets
+#define LOADGEN_MAGIC 0x6c67656e // "lgen"
+#define PAYLOAD_SIZE 20 // Magic, sequence number and timestamp
+
+// Round trip times go in a log-linear histogram: exact below
+// 2*HIST_SUB ns, then HIST_SUB buckets for each power of 2, so
+// values are good to about 3%. The last bucket takes everything
+// bigger.
+#define HIST_SUBBITS 5
+#define HIST_SUB (1 << HIST_SUBBITS)
+#define HIST_NBUCKETS ((64-HIST_SUBBITS)*HIST_SUB)
+
+static inline int histbucket(uint64_t ns)
+{
+  if (ns < 2*HIST_SUB) return ns;
+  int e = 63 - __builtin_clzll(ns);
+  int bucket = (e-HIST_SUBBITS)*HIST_SUB + (ns >> (e-HIST_SUBBITS));
+  if (bucket >= HIST_NBUCKETS) bucket = HIST_NBUCKETS-1;
+  return bucket;
+}
+
+// The smallest value in a bucket
+static inline uint64_t histvalue(int bucket)
+{
+  if (bucket < 2*HIST_SUB) return bucket;
+  int e = bucket/HIST_SUB + HIST_SUBBITS - 1;
+  uint64_t m = bucket%HIST_SUB + HIST_SUB;
+  return m << (e-HIST_SUBBITS);
+}
+
+static inline uint64_t now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// Attach to (or create) a tun device
+static int tun_open(const char *dev)
+{
+  int fd = open("/dev/net/tun", O_RDWR);
+  CHECKFD(fd);
+  ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+  strncpy(ifr.ifr_name, dev, IFNAMSIZ-1);
+  CHECKSYS(ioctl(fd, TUNSETIFF, (void *)&ifr));
+  return fd;
+}
+
+struct Generator
+{
+  int fd;
+  int proto;
+  int version;
+  uint8_t src[16];
+  uint8_t dst[16];
+  size_t size;
+  int nflows;
+  uint64_t maxage; // Longest round trip to count, in ns
+  // Results, written by the receiver
+  uint64_t received;
+  uint64_t reordered;
+  uint64_t maxseq;
+  uint64_t bytes;
+  uint64_t minrtt, maxrtt;
+  uint64_t hist[HIST_NBUCKETS];
+  // Set when the receiver should finish
+  bool stop;
+};
+
+// Make the packet with the given sequence number, timestamped now
+static void makepacket(Generator *g, uint8_t *p, uint64_t seq)
+{
+  size_t hlen = (g->version == 4) ? 20 : 40;
+  size_t l4len = g->size - hlen;
+  uint8_t *l4 = p + hlen;
+  memset(p, 0, g->size);
+  uint32_t pseudo;
+  if (g->version == 4) {
+    p[0] = 0x45;
+    put16(p+2, htons(g->size));
+    put16(p+4, htons(seq));
+    p[8] = 64;
+    p[PROTO_OFFSET] = g->proto;
+    memcpy(p+SRC_OFFSET4, g->src, 4);
+    memcpy(p+DST_OFFSET4, g->dst, 4);
+    put16(p+10, htons(~ipsum(p, 20)));
+    pseudo = ipsum(p+SRC_OFFSET4, 8, g->proto + l4len);
+  } else {
+    p[0] = 0x60;
+    put16(p+4, htons(l4len));
+    p[6] = g->proto;
+    p[7] = 64;
+    memcpy(p+SRC_OFFSET6, g->src, 16);
+    memcpy(p+DST_OFFSET6, g->dst, 16);
+    pseudo = ipsum(p+SRC_OFFSET6, 32, g->proto + l4len);
+  }
+  // Spread the flows over source ports
+  put16(l4, htons(10000 + seq % g->nflows));
+  put16(l4+2, htons(9));
+  size_t thlen, csumoffset;
+  if (g->proto == PROTO_TCP) {
+    thlen = 20;
+    put32(l4+4, htonl(seq));
+    l4[12] = 5 << 4;
+    l4[13] = 0x18; // PSH|ACK, so it looks like data on a connection
+    put16(l4+14, htons(65535));
+    csumoffset = 16;
+  } else {
+    thlen = 8;
+    put16(l4+4, htons(l4len));
+    csumoffset = 6;
+  }
+  uint8_t *payload = l4 + thlen;
+  put32(payload, LOADGEN_MAGIC);
+  memcpy(payload+4, &seq, 8);
+  uint64_t t = now();
+  memcpy(payload+12, &t, 8);
+  uint16_t csum = ~ipsum(l4, l4len, pseudo);
+  if (g->proto == PROTO_UDP && csum == 0) csum = 0xffff;
+  put16(l4+csumoffset, htons(csum));
+}
+
+// Check a packet is one of ours, coming back, and record its round trip
+static void receivepacket(Generator *g, uint8_t *p, size_t nbytes, uint64_t t)
+{
+  if (nbytes < 1 || (p[0] >> 4) != g->version) return;
+  size_t hlen = (g->version == 4) ? 4*(p[HLEN_OFFSET]&0x0f) : 40;
+  int proto = (g->version == 4) ? p[PROTO_OFFSET] : p[6];
+  if (proto != g->proto) return;
+  size_t thlen = (proto == PROTO_TCP) ? 20 : 8;
+  if (nbytes < hlen + thlen + PAYLOAD_SIZE) return;
+  uint8_t *payload = p + hlen + thlen;
+  if (get32(payload) != LOADGEN_MAGIC) return;
+  uint64_t seq, sent;
+  memcpy(&seq, payload+4, 8);
+  memcpy(&sent, payload+12, 8);
+  // The timestamp comes from the packet, so don't trust it
+  if (sent > t || t - sent > g->maxage) return;
+  uint64_t rtt = t - sent;
+  if (g->received == 0 || rtt < g->minrtt) g->minrtt = rtt;
+  if (rtt > g->maxrtt) g->maxrtt = rtt;
+  if (g->received > 0 && seq < g->maxseq) g->reordered++;
+  else g->maxseq = seq;
+  g->received++;
+  g->bytes += nbytes;
+  g->hist[histbucket(rtt)]++;
+}
+
+static void *receiver(void *arg)
+{
+  Generator *g = (Generator *)arg;
+  uint8_t buf[65536];
+  while (!__atomic_load_n(&g->stop, __ATOMIC_ACQUIRE)) {
+    pollfd pfd = { g->fd, POLLIN, 0 };
+    int n = poll(&pfd, 1, 100);
+    if (n < 0 && errno == EINTR) continue;
+    CHECK(n >= 0);
+    if (n == 0) continue;
+    ssize_t nread = read(g->fd, buf, sizeof(buf));
+    if (nread < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+    CHECK(nread >= 0);
+    receivepacket(g, buf, nread, now());
+  }
+  return NULL;
+}
+
+// The round trip time that the given fraction of packets were under
+static double percentile(const Generator *g, double fraction)
+{
+  uint64_t target = g->received*fraction, count = 0;
+  for (int i = 0; i < HIST_NBUCKETS; i++) {
+    count += g->hist[i];
+    if (count > target) return std::min(histvalue(i+1), g->maxrtt)/1e3;
+  }
+  return g->maxrtt/1e3;
+}
+
+static bool parseaddr(const char *s, uint8_t *addr, int *version)
+{
+  memset(addr, 0, 16);
+  if (inet_pton(AF_INET, s, addr) == 1) {
+    *version = 4;
+    return true;
+  }
+  if (inet_pton(AF_INET6, s, addr) == 1) {
+    *version = 6;
+    return true;
+  }
+  return false;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *progname = argv[0];
+  const char *usage =
+    "Usage: %s [--v] [--proto udp|tcp] [--src <addr>] [--dst <addr>] [--size N]"
+    " [--rate PPS] [--duration S] [--count N] [--flows N] [--wait S] <devname>\n";
+  const char *srcaddr = "10.1.0.2";
+  const char *dstaddr = "10.0.0.2";
+  int proto = PROTO_UDP;
+  int size = 0;
+  double rate = 0;
+  double duration = 1;
+  uint64_t count = 0;
+  int nflows = 1;
+  double wait = 1;
+  argc--; argv++;
+  while (argc > 0 && argv[0][0] == '-') {
+    if (strcmp(argv[0],"--v") == 0) {
+      verbosity++;
+    } else if (strcmp(argv[0],"--proto") == 0 && argc > 1) {
+      argc--; argv++;
+      if (strcmp(argv[0],"udp") == 0) {
+        proto = PROTO_UDP;
+      } else if (strcmp(argv[0],"tcp") == 0) {
+        proto = PROTO_TCP;
+      } else {
+        fprintf(stderr, usage, progname);
+        exit(0);
+      }
+    } else if (strcmp(argv[0],"--src") == 0 && argc > 1) {
+      argc--; argv++;
+      srcaddr = argv[0];
+    } else if (strcmp(argv[0],"--dst") == 0 && argc > 1) {
+      argc--; argv++;
+      dstaddr = argv[0];
+    } else if (strcmp(argv[0],"--size") == 0 && argc > 1) {
+      argc--; argv++;
+      size = atoi(argv[0]);
+    } else if (strcmp(argv[0],"--rate") == 0 && argc > 1) {
+      argc--; argv++;
+      rate = atof(argv[0]);
+    } else if (strcmp(argv[0],"--duration") == 0 && argc > 1) {
+      argc--; argv++;
+      duration = atof(argv[0]);
+    } else if (strcmp(argv[0],"--count") == 0 && argc > 1) {
+      argc--; argv++;
+      count = strtoull(argv[0], NULL, 10);
+    } else if (strcmp(argv[0],"--flows") == 0 && argc > 1) {
+      argc--; argv++;
+      nflows = atoi(argv[0]);
+    } else if (strcmp(argv[0],"--wait") == 0 && argc > 1) {
+      argc--; argv++;
+      wait = atof(argv[0]);
+    } else {
+      fprintf(stderr, usage, progname);
+      exit(0);
+    }
+    argc--; argv++;
+  }
+  if (argc != 1 || rate < 0 || duration <= 0 || nflows < 1 || wait < 0) {
+    fprintf(stderr, usage, progname);
+    exit(0);
+  }
+
+  Generator *g = new Generator;
+  memset(g, 0, sizeof(*g));
+  int srcversion;
+  if (!parseaddr(srcaddr, g->src, &srcversion) ||
+      !parseaddr(dstaddr, g->dst, &g->version) || srcversion != g->version) {
+    fprintf(stderr, "%s: bad addresses %s and %s\n", progname, srcaddr, dstaddr);
+    exit(0);
+  }
+  g->proto = proto;
+  g->nflows = nflows;
+  g->maxage = wait*1e9;
+  size_t minsize = ((g->version == 4) ? 20 : 40) + ((proto == PROTO_TCP) ? 20 : 8) + PAYLOAD_SIZE;
+  if (size == 0) size = std::max<int>(64, minsize);
+  if (size < (int)minsize || size > 1500) {
+    fprintf(stderr, "%s: --size must be between %zu and 1500\n", progname, minsize);
+    exit(0);
+  }
+  g->size = size;
+  g->fd = tun_open(argv[0]);
+
+  pthread_t thread;
+  CHECKSYS(pthread_create(&thread, NULL, receiver, g));
+
+  // Send at the given rate, sleeping when we are far enough ahead,
+  // for the duration or until count packets have gone.
+  uint8_t buf[1500];
+  uint64_t interval = (rate > 0) ? 1e9/rate : 0;
+  uint64_t start = now();
+  uint64_t end = start + duration*1e9;
+  uint64_t sent = 0, senderrors = 0;
+  while (true) {
+    uint64_t t = now();
+    if (count > 0 ? sent >= count : t >= end) break;
+    if (interval > 0) {
+      uint64_t due = start + sent*interval;
+      if (t < due) {
+        if (due - t > 50000) {
+          timespec ts = { (time_t)(due/1000000000), (long)(due%1000000000) };
+          clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        continue;
+      }
+    }
+    makepacket(g, buf, sent);
+    if (write(g->fd, buf, g->size) < 0) {
+      // Eg. the device is down, count it as lost
+      senderrors++;
+    }
+    sent++;
+  }
+  double elapsed = (now() - start)/1e9;
+  // Give the last packets time to come back
+  usleep(wait*1e6);
+  __atomic_store_n(&g->stop, true, __ATOMIC_RELEASE);
+  CHECKSYS(pthread_join(thread, NULL));
+
+  uint64_t lost = (sent > g->received) ? sent - g->received : 0;
+  printf("sent %lu packets in %.3fs: %.0f pkts/s %.2f Mbit/s\n",
+         sent, elapsed, sent/elapsed, sent*g->size*8/elapsed/1e6);
+  printf("received %lu: %.0f pkts/s %.2f Mbit/s, lost %lu (%.3f%%)",
+         g->received, g->received/elapsed, g->bytes*8/elapsed/1e6,
+         lost, sent > 0 ? 100.0*lost/sent : 0);
+  if (g->reordered > 0) printf(", reordered %lu", g->reordered);
+  if (senderrors > 0) printf(", send errors %lu", senderrors);
+  printf("\n");
+  if (g->received > 0) {
+    printf("rtt us: min %.1f p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+           g->minrtt/1e3, percentile(g,0.5), percentile(g,0.99),
+           percentile(g,0.999), g->maxrtt/1e3);
+  }
+  if (verbosity > 0) {
+    for (int i = 0; i < HIST_NBUCKETS; i++) {
+      if (g->hist[i] == 0) continue;
+      if (i == HIST_NBUCKETS-1) printf("  >=%.1fus: %lu\n", histvalue(i)/1e3, g->hist[i]);
+      else printf("  <%.1fus: %lu\n", histvalue(i+1)/1e3, g->hist[i]);
+    }
+  }
+  close(g->fd);
+  delete g;
+}
@@ -0,0 +1,62 @@
+#include <assert.h>
+
+#include "lpm.h"
+
+LPMTable::LPMTable(int addrlen_, uint32_t value)
+  : addrlen(addrlen_)
+{
+  assert(addrlen == 4 || addrlen == 16);
+  clear(value);
+}
+
+void LPMTable::clear(uint32_t value)
+{
+  assert(!(value & CHILD));
+  table.assign(1 << ROOTBITS, value);
+}
+
+// Set the entry at index, and everything below it, to value.
+void LPMTable::fill(uint32_t index, uint32_t value)
+{
+  uint32_t e = table[index];
+  if (e & CHILD) {
+    uint32_t base = e & ~CHILD;
+    for (uint32_t i = 0; i < (1 << CHUNKBITS); i++) fill(base+i, value);
+  } else {
+    table[index] = value;
+  }
+}
+
+// Return the start of the chunk below the entry at index, making a
+// new one (inheriting the entry's current value) if necessary.
+uint32_t LPMTable::child(uint32_t index)
+{
+  uint32_t e = table[index];
+  if (e & CHILD) return e & ~CHILD;
+  uint32_t base = table.size();
+  assert(base < CHILD);
+  table.resize(base + (1 << CHUNKBITS), e);
+  table[index] = base | CHILD;
+  return base;
+}
+
+void LPMTable::add(const uint8_t *addr, int prefixlen, uint32_t value)
+{
+  assert(prefixlen >= 0 && prefixlen <= 8*addrlen);
+  assert(!(value & CHILD));
+  uint32_t base = 0;
+  int bits = ROOTBITS;
+  uint32_t key = (addr[0] << 8) | addr[1];
+  int i = 2;
+  // Go down until the prefix ends in the current level
+  while (prefixlen > bits) {
+    base = child(base + key);
+    prefixlen -= bits;
+    bits = CHUNKBITS;
+    key = addr[i++];
+  }
+  // And fill in all the entries it covers
+  int spare = bits - prefixlen;
+  uint32_t first = (key >> spare) << spare;
+  for (uint32_t j = 0; j < (1U << spare); j++) fill(base + first + j, value);
+}
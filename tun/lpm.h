@@ -0,0 +1,50 @@
+// Longest prefix match table for IPv4 and IPv6 destinations.
+//
+// A multibit trie in the DIR-24-8 style, but with a 16 bit first
+// level and 8 bit levels below that (so the tables stay small enough
+// for IPv6): a lookup is at most 3 array reads for IPv4 and 15 for
+// IPv6, with no branching on the prefixes present and no allocation.
+// Prefixes are expanded (and pushed down to the leaves) as they are
+// added, so must be added shortest first.
+
+#if !defined LPM_H
+#define LPM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+struct LPMTable
+{
+  // Entries with this bit set refer to the next level chunk,
+  // starting at the given index in the table.
+  static const uint32_t CHILD = 0x80000000;
+  static const int ROOTBITS = 16;
+  static const int CHUNKBITS = 8;
+
+  LPMTable(int addrlen, uint32_t value = 0);
+  // Reset to a single default value for everything
+  void clear(uint32_t value);
+  // Add addr/prefixlen, overriding any shorter prefixes
+  void add(const uint8_t *addr, int prefixlen, uint32_t value);
+  // Number of second (and lower) level chunks
+  size_t nchunks() const {
+    return (table.size() - (1 << ROOTBITS)) >> CHUNKBITS;
+  }
+
+  uint32_t lookup(const uint8_t *addr) const {
+    const uint32_t *t = table.data();
+    uint32_t e = t[(addr[0] << 8) | addr[1]];
+    for (int i = 2; e & CHILD; i++) e = t[(e & ~CHILD) + addr[i]];
+    return e;
+  }
+
+  int addrlen; // In bytes, 4 or 16
+  std::vector<uint32_t> table;
+
+private:
+  void fill(uint32_t index, uint32_t value);
+  uint32_t child(uint32_t index);
+};
+
+#endif
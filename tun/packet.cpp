@@ -0,0 +1,569 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "packet.h"
+
+int verbosity = 0;
+int trace = 0;
+
+static void printbytes(uint8_t *p, size_t nbytes)
+{
+  for (size_t i = 0; i < nbytes; i++) {
+    printf("%02x%s",
+	   p[i],
+	   ((i+1)%16 == 0 || i+1 == nbytes)?"\n":" ");
+  }
+}
+
+void swap(uint8_t *p, uint8_t *q, int nbytes)
+{
+  for (int i = 0; i < nbytes; i++) {
+    uint8_t t = *p; *p = *q; *q = t;
+    p++; q++;
+  }
+}
+
+// Classify a packet (or an ethernet frame, if tap is true).
+PacketClass classify(uint8_t *p, size_t nbytes, bool tap)
+{
+  if (tap) {
+    if (nbytes < 14) return CLASS_OTHER;
+    uint16_t etype = ntohs(get16(p+12));
+    if (etype == 0x0806) return CLASS_ARP;
+    if (etype != 0x0800 && etype != 0x86dd) return CLASS_OTHER;
+    p += 14; nbytes -= 14;
+  }
+  if (nbytes < 1) return CLASS_OTHER;
+  switch (p[0] >> 4) {
+  case 4:
+    if (nbytes < 20) return CLASS_OTHER;
+    switch (p[PROTO_OFFSET]) {
+    case PROTO_TCP: return CLASS_TCP4;
+    case PROTO_UDP: return CLASS_UDP4;
+    case PROTO_ICMP: return CLASS_ICMP4;
+    default: return CLASS_IP4;
+    }
+  case 6:
+    if (nbytes < 40) return CLASS_OTHER;
+    // Next header, ignoring any extension headers
+    switch (p[6]) {
+    case PROTO_TCP: return CLASS_TCP6;
+    case PROTO_UDP: return CLASS_UDP6;
+    case PROTO_ICMP6: return CLASS_ICMP6;
+    default: return CLASS_IP6;
+    }
+  default:
+    return CLASS_OTHER;
+  }
+}
+
+// Rewrite packet to exchange src and dst addresses
+// Compare start and end states
+// Raise exceptions to indicate errors rather than exit()
+// Leave printing errors to caller.
+// Checks: p is non-null, nbytes is big enough for IP header
+// check on other fields - eg header length? 
+// Check IP checksum afterwards.
+// check no other bytes changed by function
+
+void describe4(uint8_t *p, size_t nbytes, const char *dev)
+{
+   char fromaddr[INET_ADDRSTRLEN];
+   char toaddr[INET_ADDRSTRLEN];
+   int headerlen = 4*(p[HLEN_OFFSET]&0x0f);
+   int proto = p[PROTO_OFFSET];
+   inet_ntop(AF_INET, p+SRC_OFFSET4, fromaddr, sizeof(fromaddr));
+   inet_ntop(AF_INET, p+DST_OFFSET4, toaddr, sizeof(toaddr));
+   uint8_t *phdr = p+headerlen;
+   if (proto == PROTO_TCP) {
+      // Should do this for IPv6 as well
+      uint16_t srcport = ntohs(get16(phdr+0));
+      uint16_t dstport = ntohs(get16(phdr+2));
+      uint16_t flags = 0x0f & get8(phdr+13);
+      char flagstring[16];
+      snprintf(flagstring, sizeof(flagstring),
+               "%s%s%s%s",
+               (flags&1)?"F":"",
+               (flags&2)?"S":"", 
+               (flags&4)?"R":"",
+               (flags&8)?"P":"");
+      printf("dev=%s src=%s:%hu dst=%s:%hu len=%zu proto=%d flags=%s\n", 
+             dev, fromaddr, srcport, toaddr, dstport, nbytes, proto, flagstring);
+   } else if (proto == PROTO_UDP) {
+      uint16_t srcport = ntohs(get16(phdr+0));
+      uint16_t dstport = ntohs(get16(phdr+2));
+      printf("proto=4 dev=%s src=%s:%hu dst=%s:%hu len=%zu proto=%d\n",
+             dev, fromaddr, srcport, toaddr, dstport, nbytes, proto);
+   } else {
+      printf("proto=4 dev=%s src=%s dst=%s len=%zu proto=%d\n",
+             dev, fromaddr, toaddr, nbytes, proto);
+   }
+}
+
+void describe6(uint8_t *p, size_t nbytes, const char *dev)
+{
+  char fromaddr[INET6_ADDRSTRLEN];
+  char toaddr[INET6_ADDRSTRLEN];
+  inet_ntop(AF_INET6, p+SRC_OFFSET6, fromaddr, sizeof(fromaddr));
+  inet_ntop(AF_INET6, p+DST_OFFSET6, toaddr, sizeof(toaddr));
+  printf("proto=6 dev=%s src=%s dst=%s nbytes=%zu\n",
+         dev, fromaddr, toaddr, nbytes);
+  printbytes(p,40); // Just the header
+}
+
+void describearp(uint8_t *p)
+{
+  uint16_t op = ntohs(get16(p+14+6));
+  char fromaddr[INET_ADDRSTRLEN];
+  char toaddr[INET_ADDRSTRLEN];
+  // Skip 14 bytes of ethernet header
+  inet_ntop(AF_INET, p+14+14, fromaddr, sizeof(fromaddr));
+  inet_ntop(AF_INET, p+14+24, toaddr, sizeof(toaddr));
+  // Assume ethernet and IPv4
+  printf("proto=ARP op=%u src=%s dst=%s\n",
+         op, fromaddr, toaddr);
+}
+
+void describeframe(uint8_t *p, size_t nbytes)
+{
+  uint16_t etype = ntohs(get16(p+12));
+  printf("Frame etype=%04x nbytes=%zu\n", etype, nbytes);
+  printf("Addr1: "); printbytes(p,6);
+  printf("Addr2: "); printbytes(p+6,6);
+}
+
+// Describe a packet (or frame, if tap is true) that has been captured
+// for logging, with only the first caplen of its nbytes available.
+// The buffer must be big enough for the headers, whatever caplen is.
+void describepacket(uint8_t *p, size_t caplen, size_t nbytes, const char *dev, bool tap)
+{
+  if (tap) {
+    if (caplen < 14) return;
+    describeframe(p, nbytes);
+    uint16_t etype = ntohs(get16(p+12));
+    if (etype == 0x0806) {
+      describearp(p);
+      return;
+    } else if (etype != 0x0800 && etype != 0x86dd) {
+      if (verbosity > 1) printbytes(p, caplen);
+      return;
+    }
+    p += 14; caplen -= 14; nbytes -= 14;
+  }
+  uint8_t version = (caplen > 0) ? p[0] >> 4 : 0;
+  if (version == 4 && caplen >= 20) {
+    describe4(p,nbytes,dev);
+  } else if (version == 6 && caplen >= 40) {
+    describe6(p,nbytes,dev);
+  } else {
+    printf("Unknown protocol %u: nbytes=%zu\n", version, nbytes);
+  }
+  if (verbosity > 1) printbytes(p, caplen);
+}
+
+bool doarp(uint8_t *p, size_t nbytes, const char *dev)
+{
+  (void)nbytes; (void)dev;
+  if (trace > 0) describearp(p);
+  // Now construct the ARP response
+  put16(p+14+6,htons(2)); // Operation
+  uint8_t *mac = p+14+18;
+  mac[0] = 0x02; mac[1] = 0x00;
+  memcpy(mac+2,p+14+24,4); // Use expected IP as top 4 bytes of MAC
+  memcpy(p,mac,6); // Copy to source (it will be swapped later).
+  swap(p+14+8,p+14+18,10);
+  return true;
+}
+
+// The policy tables, mapping destination prefixes to actions
+LPMTable policy4(4, ACTION_REFLECT);
+LPMTable policy6(16, ACTION_REFLECT);
+
+const char *actionnames[NACTIONS] = { "reflect", "drop", "pass" };
+
+// Used if there is no policy file. Reflecting multicast (or the
+// reserved 240.0.0.0/4) would give an invalid source address.
+static const char *defaultpolicy[] = {
+  "224.0.0.0/3 drop",
+  "ff00::/8 drop",
+};
+
+struct PolicyRule
+{
+  int addrlen;
+  uint8_t addr[16];
+  int prefixlen;
+  Action action;
+};
+
+// Parse "<prefix>/<len> <action>", returning false if it isn't valid
+static bool parserule(const char *line, PolicyRule *rule)
+{
+  char prefix[64], action[16], extra[2];
+  if (sscanf(line, "%63s %15s %1s", prefix, action, extra) != 2) return false;
+  char *slash = strchr(prefix, '/');
+  if (slash == NULL) return false;
+  *slash = 0;
+  char *end;
+  long prefixlen = strtol(slash+1, &end, 10);
+  if (*end != 0 || end == slash+1) return false;
+  memset(rule->addr, 0, sizeof(rule->addr));
+  if (inet_pton(AF_INET, prefix, rule->addr) == 1) {
+    rule->addrlen = 4;
+  } else if (inet_pton(AF_INET6, prefix, rule->addr) == 1) {
+    rule->addrlen = 16;
+  } else {
+    return false;
+  }
+  if (prefixlen < 0 || prefixlen > 8*rule->addrlen) return false;
+  rule->prefixlen = prefixlen;
+  for (int i = 0; i < NACTIONS; i++) {
+    if (strcmp(action, actionnames[i]) == 0) {
+      rule->action = (Action)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool shorterprefix(const PolicyRule &r1, const PolicyRule &r2)
+{
+  return r1.prefixlen < r2.prefixlen;
+}
+
+// Load the policy from a file of "<prefix>/<len> <action>" lines, with
+// '#' comments, or the default policy if filename is NULL.
+// Anything not covered by a rule is reflected, the most specific
+// rule wins and later rules override earlier ones for the same prefix.
+void loadpolicy(const char *filename)
+{
+  std::vector<PolicyRule> rules;
+  PolicyRule rule;
+  if (filename == NULL) {
+    for (size_t i = 0; i < sizeof(defaultpolicy)/sizeof(*defaultpolicy); i++) {
+      CHECK(parserule(defaultpolicy[i], &rule));
+      rules.push_back(rule);
+    }
+  } else {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+      fprintf(stderr, "Can't open policy file %s: %s\n", filename, strerror(errno));
+      exit(0);
+    }
+    char line[256];
+    for (int lineno = 1; fgets(line, sizeof(line), fp) != NULL; lineno++) {
+      char *comment = strchr(line, '#');
+      if (comment != NULL) *comment = 0;
+      char token[2];
+      if (sscanf(line, "%1s", token) != 1) continue; // Blank line
+      if (!parserule(line, &rule)) {
+        fprintf(stderr, "%s:%d: bad policy rule: %s", filename, lineno, line);
+        exit(0);
+      }
+      rules.push_back(rule);
+    }
+    fclose(fp);
+  }
+  // The tables need prefixes adding shortest first
+  std::stable_sort(rules.begin(), rules.end(), shorterprefix);
+  policy4.clear(ACTION_REFLECT);
+  policy6.clear(ACTION_REFLECT);
+  for (size_t i = 0; i < rules.size(); i++) {
+    LPMTable &table = (rules[i].addrlen == 4) ? policy4 : policy6;
+    table.add(rules[i].addr, rules[i].prefixlen, rules[i].action);
+  }
+  if (verbosity > 0) {
+    printf("Policy: %zu rules, %zu IPv4 chunks, %zu IPv6 chunks\n",
+           rules.size(), policy4.nchunks(), policy6.nchunks());
+  }
+}
+
+Rewrite rewrite4;
+Rewrite rewrite6;
+bool verifycsum = false;
+
+bool setrewrite(const char *prefix)
+{
+  PolicyRule rule;
+  char line[80];
+  snprintf(line, sizeof(line), "%s reflect", prefix);
+  if (!parserule(line, &rule)) return false;
+  Rewrite &r = (rule.addrlen == 4) ? rewrite4 : rewrite6;
+  r.enabled = true;
+  memcpy(r.addr, rule.addr, sizeof(r.addr));
+  r.prefixlen = rule.prefixlen;
+  for (int i = 0; i < 16; i++) {
+    int bits = rule.prefixlen - 8*i;
+    r.mask[i] = (bits >= 8) ? 0xff : (bits <= 0) ? 0 : (uint8_t)(0xff00 >> bits);
+  }
+  if (verbosity > 0) printf("Rewriting sources to %s\n", prefix);
+  return true;
+}
+
+// Fold a sum of less than 2^48 to 16 bits, in a fixed number of
+// steps to save on mispredicted branches.
+static inline uint16_t fold(uint64_t sum)
+{
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
+
+uint16_t ipsum(const uint8_t *p, size_t nbytes, uint32_t sum)
+{
+  // Sum the words in host order (the one's complement sum doesn't
+  // care about byte order as long as we swap back at the end), 16
+  // bytes at a time into 32 bit lanes. Packets are far too short for
+  // the lanes to overflow.
+  uint64_t acc = 0;
+  size_t i = 0;
+#if defined __SSE2__
+  __m128i zero = _mm_setzero_si128();
+  __m128i vacc = zero;
+  for (; i+16 <= nbytes; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p+i));
+    vacc = _mm_add_epi32(vacc, _mm_unpacklo_epi16(v, zero));
+    vacc = _mm_add_epi32(vacc, _mm_unpackhi_epi16(v, zero));
+  }
+  uint32_t lanes[4];
+  _mm_storeu_si128((__m128i *)lanes, vacc);
+  acc = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; i+1 < nbytes; i += 2) {
+    uint16_t w;
+    memcpy(&w, p+i, 2);
+    acc += w;
+  }
+  acc = ntohs(fold(acc)) + (uint64_t)sum;
+  if (nbytes & 1) acc += p[nbytes-1] << 8;
+  return fold(acc);
+}
+
+// Where the transport header of an IP packet is, if it has a
+// checksum we know about (and isn't a later fragment).
+struct Transport
+{
+  int proto;
+  size_t hlen; // IP header(s)
+  size_t len; // Transport header and payload
+  size_t csumpos; // From the start of the packet
+  bool fragment; // The first of several
+};
+
+static bool transport(uint8_t *p, size_t nbytes, Transport *t)
+{
+  size_t total;
+  t->fragment = false;
+  if (p[0] >> 4 == 4) {
+    t->hlen = 4*(p[HLEN_OFFSET]&0x0f);
+    total = ntohs(get16(p+2));
+    t->proto = p[PROTO_OFFSET];
+    uint16_t frag = ntohs(get16(p+6));
+    if ((frag & 0x1fff) != 0) return false;
+    t->fragment = (frag & 0x2000) != 0;
+  } else {
+    t->hlen = 40;
+    total = 40 + ntohs(get16(p+4));
+    // Next header, ignoring any extension headers
+    t->proto = p[6];
+  }
+  // There may be padding (eg. from ethernet) after the packet
+  if (t->hlen < 20 || total > nbytes || total < t->hlen) return false;
+  size_t offset;
+  switch (t->proto) {
+  case PROTO_TCP: offset = 16; break;
+  case PROTO_UDP: offset = 6; break;
+  case PROTO_ICMP: offset = 2; break;
+  case PROTO_ICMP6: offset = 2; break;
+  default: return false;
+  }
+  t->len = total - t->hlen;
+  if (t->len < offset+2) return false;
+  t->csumpos = t->hlen + offset;
+  return true;
+}
+
+bool checksumok(uint8_t *p, size_t nbytes)
+{
+  int version = p[0] >> 4;
+  if (version == 4) {
+    size_t hlen = 4*(p[HLEN_OFFSET]&0x0f);
+    if (hlen < 20 || hlen > nbytes || ipsum(p, hlen) != 0xffff) return false;
+  }
+  Transport t;
+  // A fragment's checksum covers the whole datagram
+  if (!transport(p, nbytes, &t) || t.fragment) return true;
+  // Zero means no checksum for UDP over IPv4
+  if (version == 4 && t.proto == PROTO_UDP && get16(p+t.csumpos) == 0) return true;
+  uint32_t pseudo = 0;
+  if (version == 4 && t.proto != PROTO_ICMP) {
+    pseudo = ipsum(p+SRC_OFFSET4, 8, t.proto + t.len);
+  } else if (version == 6) {
+    pseudo = ipsum(p+SRC_OFFSET6, 32, t.proto + t.len);
+  }
+  return ipsum(p+t.hlen, t.len, pseudo) == 0xffff;
+}
+
+void finishcsum(uint8_t *p, size_t nbytes)
+{
+  Transport t;
+  if (nbytes < 20 || !transport(p, nbytes, &t) || t.proto == PROTO_ICMP) return;
+  // The checksum field already holds the pseudo-header sum
+  uint16_t csum = ~ipsum(p+t.hlen, t.len);
+  if (t.proto == PROTO_UDP && csum == 0) csum = 0xffff;
+  put16(p+t.csumpos, htons(csum));
+}
+
+// Update a checksum for a change to the data it covers, where delta
+// is the one's complement sum of ~old + new over the changed words
+// (RFC 1624, eqn. 3). A partial checksum is just a sum, not yet
+// complemented.
+static void adjustcsum(uint8_t *field, uint16_t delta, bool partial, bool udp)
+{
+  uint16_t csum = ntohs(get16(field));
+  if (partial) {
+    csum = fold(csum + delta);
+  } else {
+    csum = ~fold((uint16_t)~csum + delta);
+    // Zero would mean no checksum
+    if (udp && csum == 0) csum = 0xffff;
+  }
+  put16(field, htons(csum));
+}
+
+// Replace the prefix bits of the (just swapped in) source address,
+// and patch up the checksums that cover it.
+static void rewritesource(uint8_t *p, size_t nbytes, const Rewrite &rule, bool partialcsum)
+{
+  int version = p[0] >> 4;
+  int addrlen = (version == 4) ? 4 : 16;
+  uint8_t *src = p + ((version == 4) ? SRC_OFFSET4 : SRC_OFFSET6);
+  // A word at a time, summing ~old + new as we go (in host order,
+  // which the sum doesn't mind)
+  uint32_t sum = 0;
+  for (int i = 0; i < addrlen; i += 2) {
+    uint16_t old = get16(src+i);
+    uint16_t mask = get16((uint8_t *)rule.mask+i);
+    uint16_t addr = (get16((uint8_t *)rule.addr+i) & mask) | (old & ~mask);
+    put16(src+i, addr);
+    sum += (uint16_t)~old + addr;
+  }
+  uint16_t delta = ntohs(fold(sum));
+  if (version == 4) adjustcsum(p+10, delta, false, false);
+  Transport t;
+  if (!transport(p, nbytes, &t)) return;
+  // No pseudo-header for ICMP, and no checksum at all for some UDP
+  if (t.proto == PROTO_ICMP) return;
+  if (version == 4 && t.proto == PROTO_UDP && !partialcsum && get16(p+t.csumpos) == 0) return;
+  adjustcsum(p+t.csumpos, delta, partialcsum, t.proto == PROTO_UDP);
+}
+
+bool reflect(uint8_t *p, size_t nbytes, const char *dev, bool partialcsum)
+{
+  uint8_t version = p[0] >> 4;
+  Action action;
+  const Rewrite *rewrite;
+  switch (version) {
+  case 4:
+    if (nbytes < 20) return false;
+    if (trace > 0) describe4(p,nbytes,dev);
+    if (trace > 1) printbytes(p, nbytes);
+    action = (Action)policy4.lookup(p+DST_OFFSET4);
+    // Swap source and dest of an IPv4 packet
+    // No checksum recalculation is necessary
+    if (action == ACTION_REFLECT) swap(p+SRC_OFFSET4,p+DST_OFFSET4,4);
+    rewrite = &rewrite4;
+    break;
+  case 6:
+    if (nbytes < 40) return false;
+    if (trace > 0) describe6(p,nbytes,dev);
+    if (trace > 1) printbytes(p, nbytes);
+    action = (Action)policy6.lookup(p+DST_OFFSET6);
+    // Swap source and dest of an IPv6 packet
+    // No checksum recalculation is necessary
+    if (action == ACTION_REFLECT) swap(p+SRC_OFFSET6,p+DST_OFFSET6,16);
+    rewrite = &rewrite6;
+    break;
+  default:
+    printf("Unknown protocol %u: nbytes=%zu\n",
+           version, nbytes);
+    return false;
+  }
+  if (action != ACTION_REFLECT && trace > 0) {
+    printf("Policy: %s\n", actionnames[action]);
+  }
+  if (verifycsum && !partialcsum && !checksumok(p,nbytes)) {
+    if (trace > 0) printf("Bad checksum\n");
+    return false;
+  }
+  if (action == ACTION_REFLECT && rewrite->enabled) {
+    rewritesource(p,nbytes,*rewrite,partialcsum);
+  }
+  // Packets passed through go back unchanged
+  return action != ACTION_DROP;
+}
+
+bool reflecttap(uint8_t *p, size_t nbytes, const char *dev, bool partialcsum)
+{
+  uint16_t etype;
+  memcpy(&etype,p+12,2);
+  etype = ntohs(etype);
+  if (trace > 0) describeframe(p,nbytes);
+  bool respond = false;
+  if (etype == 0x0800 || etype == 0x86dd) {
+    // No CRC in TAP frames
+    respond = reflect(p+14,nbytes-14,dev,partialcsum);
+  } else if (etype == 0x0806) {
+    respond = doarp(p,nbytes,dev);
+  } else if (trace > 0) {
+    printbytes(p, nbytes);
+  }
+  if (respond) swap(p,p+6,6);
+  return respond;
+}
+
+// With IFF_VNET_HDR, every packet is preceded by a virtio_net_hdr
+// describing the checksum and segmentation offload still to be done.
+// Exchanging addresses doesn't change the pseudo-header checksum, so
+// any partial checksum is still correct and a GSO super-packet can
+// be reflected whole, writing the header back as is: the kernel will
+// segment it on the way back in.
+bool reflectvnet(uint8_t *p, size_t nbytes, const char *dev, int devtype)
+{
+  virtio_net_hdr hdr;
+  if (nbytes < sizeof(hdr)) return false;
+  memcpy(&hdr,p,sizeof(hdr));
+  uint8_t gsotype = hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+  if (trace > 0) {
+    printf("vnet flags=%u gso_type=%u hdr_len=%u gso_size=%u csum_start=%u csum_offset=%u\n",
+           hdr.flags, hdr.gso_type, hdr.hdr_len, hdr.gso_size,
+           hdr.csum_start, hdr.csum_offset);
+  }
+  if (gsotype != VIRTIO_NET_HDR_GSO_NONE &&
+      gsotype != VIRTIO_NET_HDR_GSO_TCPV4 &&
+      gsotype != VIRTIO_NET_HDR_GSO_TCPV6 &&
+      gsotype != VIRTIO_NET_HDR_GSO_UDP) {
+    printf("Unknown GSO type %u: nbytes=%zu\n", gsotype, nbytes);
+    return false;
+  }
+  p += sizeof(hdr);
+  nbytes -= sizeof(hdr);
+  bool partial = (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0;
+  if (devtype == IFF_TUN) {
+    return reflect(p,nbytes,dev,partial);
+  } else {
+    return reflecttap(p,nbytes,dev,partial);
+  }
+}
+
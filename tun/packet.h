@@ -0,0 +1,144 @@
+// Packet handling for reflect, shared with the benchmark.
+
+#if !defined PACKET_H
+#define PACKET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <linux/if_tun.h>
+// virtio_net.h has a struct member called 'class', so isn't C++ friendly
+#define class class_
+#include <linux/virtio_net.h>
+#undef class
+
+#include "lpm.h"
+
+// Some handy macros to help with error checking
+#define CHECKAUX(e,s)                            \
+ ((e)? \
+  (void)0: \
+  (fprintf(stderr, "'%s' failed at %s:%d - %s\n", \
+           s, __FILE__, __LINE__,strerror(errno)), \
+   exit(0)))
+#define CHECK(e) (CHECKAUX(e,#e))
+#define CHECKSYS(e) (CHECKAUX((e)==0,#e))
+#define CHECKFD(e) (CHECKAUX((e)>=0,#e))
+
+#define STRING(e) #e
+
+extern int verbosity;
+// Per-packet printing in the packet functions themselves. reflect
+// leaves this off and logs packets from another thread instead.
+extern int trace;
+
+static inline void put32(uint8_t *p, uint32_t n)
+{
+  memcpy(p,&n,sizeof(n));
+}
+
+static inline void put16(uint8_t *p, uint16_t n)
+{
+  memcpy(p,&n,sizeof(n));
+}
+
+static inline void put8(uint8_t *p, uint8_t n)
+{
+  *p = n;
+}
+
+static inline uint32_t get32(uint8_t *p)
+{
+  uint32_t n;
+  memcpy(&n,p,sizeof(n));
+  return n;
+}
+
+static inline uint16_t get16(uint8_t *p)
+{
+  uint16_t n;
+  memcpy(&n,p,sizeof(n));
+  return n;
+}
+
+static inline uint8_t get8(uint8_t *p)
+{
+  return *p;
+}
+
+#define SRC_OFFSET4 12
+#define DST_OFFSET4 16
+#define SRC_OFFSET6 8
+#define DST_OFFSET6 24
+#define HLEN_OFFSET 0
+#define PROTO_OFFSET 9
+#define PROTO_ICMP 1
+#define PROTO_IGMP 2
+#define PROTO_TCP 6
+#define PROTO_UDP 17
+#define PROTO_ICMP6 58
+
+// Packet classes for benchmarking and statistics
+enum PacketClass {
+  CLASS_TCP4, CLASS_UDP4, CLASS_ICMP4, CLASS_IP4,
+  CLASS_TCP6, CLASS_UDP6, CLASS_ICMP6, CLASS_IP6,
+  CLASS_ARP, CLASS_OTHER,
+  NCLASSES
+};
+
+static const char *const classnames[NCLASSES] = {
+  "tcp4", "udp4", "icmp4", "ip4",
+  "tcp6", "udp6", "icmp6", "ip6",
+  "arp", "other"
+};
+
+// What to do with a packet, looked up by destination address
+enum Action { ACTION_REFLECT, ACTION_DROP, ACTION_PASS, NACTIONS };
+extern const char *actionnames[NACTIONS];
+extern LPMTable policy4;
+extern LPMTable policy6;
+void loadpolicy(const char *filename);
+
+// Rewriting the source of reflected packets, like a NAT: the prefix
+// bits of the new source come from the rule, the rest from the
+// address the packet was sent to. A /32 or /128 gives a fixed source.
+struct Rewrite
+{
+  bool enabled;
+  uint8_t addr[16];
+  uint8_t mask[16];
+  int prefixlen;
+};
+extern Rewrite rewrite4;
+extern Rewrite rewrite6;
+// Set the rule for the family of "<prefix>/<len>", false if invalid
+bool setrewrite(const char *prefix);
+// Drop packets with bad checksums before reflecting them
+extern bool verifycsum;
+
+// The one's complement sum of nbytes at p (as big endian 16 bit
+// words) added to sum, folded to 16 bits but not complemented.
+uint16_t ipsum(const uint8_t *p, size_t nbytes, uint32_t sum = 0);
+// Check the IP header and transport checksums of an IP packet
+bool checksumok(uint8_t *p, size_t nbytes);
+// Finish off a partial transport checksum (see reflect)
+void finishcsum(uint8_t *p, size_t nbytes);
+
+PacketClass classify(uint8_t *p, size_t nbytes, bool tap);
+void swap(uint8_t *p, uint8_t *q, int nbytes);
+void describe4(uint8_t *p, size_t nbytes, const char *dev);
+void describe6(uint8_t *p, size_t nbytes, const char *dev);
+void describearp(uint8_t *p);
+void describeframe(uint8_t *p, size_t nbytes);
+void describepacket(uint8_t *p, size_t caplen, size_t nbytes, const char *dev, bool tap);
+bool doarp(uint8_t *p, size_t nbytes, const char *dev);
+// With partialcsum, the transport checksum field holds just the
+// pseudo-header sum, for the kernel (or hardware) to finish off.
+bool reflect(uint8_t *p, size_t nbytes, const char *dev, bool partialcsum = false);
+bool reflecttap(uint8_t *p, size_t nbytes, const char *dev, bool partialcsum = false);
+bool reflectvnet(uint8_t *p, size_t nbytes, const char *dev, int devtype);
+
+#endif
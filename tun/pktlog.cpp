@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "packet.h"
+#include "pktlog.h"
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+
+static void writepcapheader(Logger *logger)
+{
+  uint32_t hdr[6];
+  hdr[0] = 0xa1b2c3d4;
+  hdr[1] = 2 | (4 << 16); // Version 2.4
+  hdr[2] = 0;             // Timezone
+  hdr[3] = 0;             // Timestamp accuracy
+  hdr[4] = PKTLOG_SNAPLEN;
+  hdr[5] = logger->tap ? LINKTYPE_ETHERNET : LINKTYPE_RAW;
+  CHECK(fwrite(hdr, sizeof(hdr), 1, logger->fp) == 1);
+}
+
+static void writerecord(Logger *logger, PacketLog *log, PacketRecord *r)
+{
+  switch (logger->format) {
+  case LOG_TEXT:
+    printf("%lu.%06lu queue=%u %s%s\n",
+           r->time/1000000000, r->time%1000000000/1000, r->queue,
+           (r->flags & PKTLOG_REFLECTED) ? "reflected" : "dropped",
+           (r->flags & PKTLOG_GSO) ? " gso" : "");
+    describepacket(r->data, r->caplen, r->len, log->dev, log->tap);
+    break;
+  case LOG_PCAP: {
+    uint32_t hdr[4];
+    hdr[0] = r->time/1000000000;
+    hdr[1] = r->time%1000000000/1000;
+    hdr[2] = r->caplen;
+    hdr[3] = r->len;
+    CHECK(fwrite(hdr, sizeof(hdr), 1, logger->fp) == 1);
+    CHECK(fwrite(r->data, r->caplen, 1, logger->fp) == 1 || r->caplen == 0);
+    break;
+  }
+  case LOG_BINARY:
+    CHECK(fwrite(r, offsetof(PacketRecord, data) + r->caplen, 1, logger->fp) == 1);
+    break;
+  }
+}
+
+// Empty each ring in turn, returning the number of records written
+static size_t drain(Logger *logger)
+{
+  size_t n = 0;
+  for (int i = 0; i < logger->nlogs; i++) {
+    PacketLog *log = &logger->logs[i];
+    uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = log->tail;
+    for ( ; tail != head; tail++) {
+      writerecord(logger, log, &log->records[tail & log->mask]);
+      n++;
+    }
+    __atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+static void *logthread(void *arg)
+{
+  Logger *logger = (Logger *)arg;
+  while (!__atomic_load_n(&logger->stop, __ATOMIC_ACQUIRE)) {
+    if (drain(logger) == 0) {
+      // Nothing to do, so flush and wait a while. Polling keeps the
+      // packet threads from ever having to wake us up.
+      fflush(logger->fp);
+      timespec delay = { 0, 1000000 };
+      nanosleep(&delay, NULL);
+    }
+  }
+  drain(logger);
+  fflush(logger->fp);
+  return NULL;
+}
+
+Logger *startlogger(int nlogs, int size, LogFormat format,
+                    const char *filename, const char *dev, bool tap)
+{
+  Logger *logger = new Logger;
+  memset(logger, 0, sizeof(*logger));
+  int ringsize = 1;
+  while (ringsize < size) ringsize <<= 1;
+  logger->logs = new PacketLog[nlogs];
+  for (int i = 0; i < nlogs; i++) {
+    PacketLog *log = &logger->logs[i];
+    memset(log, 0, sizeof(*log));
+    log->records = new PacketRecord[ringsize];
+    log->mask = ringsize-1;
+    log->dev = dev;
+    log->tap = tap;
+  }
+  logger->nlogs = nlogs;
+  logger->format = format;
+  logger->dev = dev;
+  logger->tap = tap;
+  if (filename == NULL || strcmp(filename, "-") == 0 || format == LOG_TEXT) {
+    logger->fp = stdout;
+  } else {
+    logger->fp = fopen(filename, "wb");
+    if (logger->fp == NULL) {
+      fprintf(stderr, "Can't open log file %s: %s\n", filename, strerror(errno));
+      exit(0);
+    }
+  }
+  if (format == LOG_PCAP) writepcapheader(logger);
+  CHECKSYS(pthread_create(&logger->thread, NULL, logthread, logger));
+  return logger;
+}
+
+void stoplogger(Logger *logger)
+{
+  __atomic_store_n(&logger->stop, true, __ATOMIC_RELEASE);
+  CHECKSYS(pthread_join(logger->thread, NULL));
+  for (int i = 0; i < logger->nlogs; i++) {
+    delete [] logger->logs[i].records;
+  }
+  if (logger->fp != stdout) fclose(logger->fp);
+  delete [] logger->logs;
+  delete logger;
+}
@@ -0,0 +1,95 @@
+// Asynchronous packet logging for reflect.
+//
+// The packet thread just copies the start of each packet into a
+// fixed size record in a single producer, single consumer ring; a
+// background thread empties the rings and does the formatting and
+// writing. If a ring is full, the record is dropped (and counted in
+// the packet thread's statistics) rather than holding up the packet
+// thread.
+//
+// Output is one of:
+//  text: the usual --v descriptions, on stdout
+//  pcap: a standard capture file, truncated to PKTLOG_SNAPLEN
+//  binary: each record header (as PacketRecord, host byte order)
+//          followed by caplen bytes of packet.
+
+#if !defined PKTLOG_H
+#define PKTLOG_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define PKTLOG_SNAPLEN 128
+
+enum LogFormat { LOG_TEXT, LOG_PCAP, LOG_BINARY };
+
+// Record flags
+#define PKTLOG_REFLECTED 1
+#define PKTLOG_GSO 2
+
+struct PacketRecord
+{
+  uint64_t time; // ns since the epoch
+  uint32_t len;  // Original length
+  uint32_t queue; // With epoll, one per device, so can be many
+  uint16_t caplen;
+  uint8_t flags;
+  uint8_t data[PKTLOG_SNAPLEN];
+};
+
+// One ring per packet thread. The producer and consumer indexes are
+// on separate cache lines, and the producer keeps its own copy of
+// the consumer index so it only needs to read the shared one when
+// the ring looks full.
+struct PacketLog
+{
+  PacketRecord *records;
+  uint64_t mask;
+  uint64_t head __attribute__((aligned(64))); // Written by the packet thread
+  uint64_t cachedtail;
+  uint64_t tail __attribute__((aligned(64))); // Written by the log thread
+  // The device the packets come from, for the text descriptions
+  const char *dev;
+  bool tap;
+};
+
+struct Logger
+{
+  PacketLog *logs;
+  int nlogs;
+  LogFormat format;
+  FILE *fp;
+  const char *dev;
+  bool tap;
+  bool stop;
+  pthread_t thread;
+};
+
+// The next free record, or NULL if the ring is full.
+static inline PacketRecord *pktlog_reserve(PacketLog *log)
+{
+  uint64_t head = log->head;
+  if (head - log->cachedtail > log->mask) {
+    log->cachedtail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+    if (head - log->cachedtail > log->mask) return NULL;
+  }
+  return &log->records[head & log->mask];
+}
+
+// Make the reserved record visible to the log thread
+static inline void pktlog_commit(PacketLog *log)
+{
+  __atomic_store_n(&log->head, log->head + 1, __ATOMIC_RELEASE);
+}
+
+// Start logging for nlogs packet threads, with rings of (at least)
+// size records each, to filename ("-" or NULL for stdout). Each log
+// starts off as from dev, which can be changed before it is used.
+Logger *startlogger(int nlogs, int size, LogFormat format,
+                    const char *filename, const char *dev, bool tap);
+// Write out everything still in the rings and stop
+void stoplogger(Logger *logger);
+
+#endif
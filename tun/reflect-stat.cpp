@@ -0,0 +1,180 @@
+// Watch the statistics of a running reflect.
+//
+// Usage: reflect-stat [--interval S] [--threads] [--once] <devname>
+//  --interval: seconds between reports, default 1
+//  --threads: report each thread (queue) as well as the total
+//  --once: print the totals so far and exit
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// A consistent enough copy of one set of counters
+static void snapshot(ThreadStats *out, const ThreadStats *in)
+{
+  out->packets = statread(&in->packets);
+  out->bytes = statread(&in->bytes);
+  out->reflected = statread(&in->reflected);
+  out->dropped = statread(&in->dropped);
+  out->gso = statread(&in->gso);
+  out->logdropped = statread(&in->logdropped);
+  out->ratelimited = statread(&in->ratelimited);
+  out->flows = statread(&in->flows);
+  for (int i = 0; i < NCLASSES; i++) out->classes[i] = statread(&in->classes[i]);
+  for (int i = 0; i < STATS_NBUCKETS; i++) out->ticks[i] = statread(&in->ticks[i]);
+}
+
+static void accumulate(ThreadStats *total, const ThreadStats *t)
+{
+  total->packets += t->packets;
+  total->bytes += t->bytes;
+  total->reflected += t->reflected;
+  total->dropped += t->dropped;
+  total->gso += t->gso;
+  total->logdropped += t->logdropped;
+  total->ratelimited += t->ratelimited;
+  total->flows += t->flows;
+  for (int i = 0; i < NCLASSES; i++) total->classes[i] += t->classes[i];
+  for (int i = 0; i < STATS_NBUCKETS; i++) total->ticks[i] += t->ticks[i];
+}
+
+static void difference(ThreadStats *d, const ThreadStats *now, const ThreadStats *then)
+{
+  d->packets = now->packets - then->packets;
+  d->bytes = now->bytes - then->bytes;
+  d->reflected = now->reflected - then->reflected;
+  d->dropped = now->dropped - then->dropped;
+  d->gso = now->gso - then->gso;
+  d->logdropped = now->logdropped - then->logdropped;
+  d->ratelimited = now->ratelimited - then->ratelimited;
+  d->flows = now->flows;
+  for (int i = 0; i < NCLASSES; i++) d->classes[i] = now->classes[i] - then->classes[i];
+  for (int i = 0; i < STATS_NBUCKETS; i++) d->ticks[i] = now->ticks[i] - then->ticks[i];
+}
+
+// Upper bound, in ns, of the bucket containing the given fraction
+// of the processing times.
+static double percentile(const ThreadStats *t, double fraction, double ticksperus)
+{
+  uint64_t n = 0;
+  for (int i = 0; i < STATS_NBUCKETS; i++) n += t->ticks[i];
+  if (n == 0) return 0;
+  uint64_t target = n*fraction, count = 0;
+  for (int i = 0; i < STATS_NBUCKETS; i++) {
+    count += t->ticks[i];
+    if (count > target || i == STATS_NBUCKETS-1) return (1ULL << i)*1e3/ticksperus;
+  }
+  return 0;
+}
+
+// Report rates over the given number of seconds, or just the
+// counts if seconds is 0.
+static void report(const char *name, const ThreadStats *d, double seconds, double ticksperus)
+{
+  if (seconds > 0) {
+    printf("%-6s %10.0f pkts/s %9.2f Mbit/s %10.0f refl/s %8.0f drop/s %8.0f gso/s",
+           name, d->packets/seconds, d->bytes*8/seconds/1e6,
+           d->reflected/seconds, d->dropped/seconds, d->gso/seconds);
+  } else {
+    printf("%-6s %10lu pkts %12lu bytes %10lu refl %8lu drop %8lu gso",
+           name, d->packets, d->bytes, d->reflected, d->dropped, d->gso);
+  }
+  printf("  p50<%.0fns p99<%.0fns",
+         percentile(d,0.5,ticksperus), percentile(d,0.99,ticksperus));
+  if (d->logdropped > 0) printf(" logdropped=%lu", d->logdropped);
+  if (d->ratelimited > 0) printf(" ratelimited=%lu", d->ratelimited);
+  if (d->flows > 0) printf(" flows=%lu", d->flows);
+  printf("\n");
+  printf("      ");
+  for (int i = 0; i < NCLASSES; i++) {
+    if (d->classes[i] == 0) continue;
+    if (seconds > 0) printf(" %s=%.0f/s", classnames[i], d->classes[i]/seconds);
+    else printf(" %s=%lu", classnames[i], d->classes[i]);
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *progname = argv[0];
+  const char *usage = "Usage: %s [--interval S] [--threads] [--once] <devname>\n";
+  double interval = 1;
+  bool perthread = false;
+  bool once = false;
+  argc--; argv++;
+  while (argc > 0 && argv[0][0] == '-') {
+    if (strcmp(argv[0],"--interval") == 0 && argc > 1) {
+      argc--; argv++;
+      interval = atof(argv[0]);
+    } else if (strcmp(argv[0],"--threads") == 0) {
+      perthread = true;
+    } else if (strcmp(argv[0],"--once") == 0) {
+      once = true;
+    } else {
+      fprintf(stderr, usage, progname);
+      exit(0);
+    }
+    argc--; argv++;
+  }
+  if (argc != 1 || interval <= 0) {
+    fprintf(stderr, usage, progname);
+    exit(0);
+  }
+  const char *dev = argv[0];
+  const StatsSegment *seg = openstats(dev);
+  if (seg == NULL) {
+    fprintf(stderr, "%s: no statistics for %s\n", progname, dev);
+    exit(0);
+  }
+  int nthreads = seg->nthreads;
+  printf("reflect pid %d on %s, %d thread%s\n",
+         seg->pid, seg->dev, nthreads, nthreads > 1 ? "s" : "");
+
+  ThreadStats *prev = new ThreadStats[nthreads+1];
+  ThreadStats *curr = new ThreadStats[nthreads+1];
+  memset(prev, 0, (nthreads+1)*sizeof(ThreadStats));
+  // Start from the current counts, so the first interval doesn't report
+  // everything reflect has done so far as if it happened just now.
+  if (!once) {
+    for (int i = 0; i < nthreads; i++) {
+      snapshot(&prev[i], &seg->threads[i]);
+      accumulate(&prev[nthreads], &prev[i]);
+    }
+  }
+  // With --once, just report the counts so far
+  double seconds = once ? 0 : interval;
+  while (true) {
+    if (!once) usleep(interval*1e6);
+    ThreadStats *total = &curr[nthreads];
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < nthreads; i++) {
+      snapshot(&curr[i], &seg->threads[i]);
+      accumulate(total, &curr[i]);
+    }
+    ThreadStats d;
+    if (perthread) {
+      for (int i = 0; i < nthreads; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "q%d", i);
+        difference(&d, &curr[i], &prev[i]);
+        report(name, &d, seconds, seg->ticksperus);
+      }
+    }
+    difference(&d, &curr[nthreads], &prev[nthreads]);
+    report("total", &d, seconds, seg->ticksperus);
+    fflush(stdout);
+    if (once) break;
+    if (kill(seg->pid, 0) < 0 && errno == ESRCH) {
+      printf("reflect pid %d has exited\n", seg->pid);
+      break;
+    }
+    ThreadStats *t = prev; prev = curr; curr = t;
+  }
+  delete [] prev;
+  delete [] curr;
+}
@@ -7,45 +7,62 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <net/if.h>
 
-#include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "packet.h"
+#include "flow.h"
+#include "pktlog.h"
+#include "stats.h"
+#include "uring.h"
 
 // Optionally, compile to use capabilities (to avoid running as root or needind setuid).
 // Might need eg. 'sudo apt-get install libcap-dev libcap2-bin' and link with -lcap
 // Set capabilities (see Makefile) with:
-// sudo setcap cap_net_admin+p ./reflect
+// sudo setcap cap_net_admin,cap_net_raw+p ./reflect
 
 #define USE_CAPABILITIES
 #if defined USE_CAPABILITIES
 #include <sys/capability.h>
 #endif
 
-// Some handy macros to help with error checking
-#define CHECKAUX(e,s)                            \
- ((e)? \
-  (void)0: \
-  (fprintf(stderr, "'%s' failed at %s:%d - %s\n", \
-           s, __FILE__, __LINE__,strerror(errno)), \
-   exit(0)))
-#define CHECK(e) (CHECKAUX(e,#e))
-#define CHECKSYS(e) (CHECKAUX((e)==0,#e))
-#define CHECKFD(e) (CHECKAUX((e)>=0,#e))
-
-#define STRING(e) #e
-
-int verbosity = 0;
+// How packets get in and out: one read() and write() per packet,
+// batches of them through io_uring, a packet socket ring on an
+// existing interface, or non-blocking reads and writes on many
+// devices at once driven by epoll.
+enum IOEngine { IO_SYSCALL, IO_URING, IO_PACKET, IO_EPOLL };
+IOEngine ioengine = IO_SYSCALL;
+// Number of packet buffers (and so in-flight operations) per queue
+// for the io_uring engine.
+int nbuffers = 64;
+// Packets come with a virtio_net_hdr and may be GSO super-packets.
+bool offload = false;
+// Size of each packet buffer, big enough for a 64K super-packet
+// and its header if we are offloading.
+size_t pktbufsize = 2048;
+#define VNET_BUFSIZE (sizeof(virtio_net_hdr)+65536)
 
 // Fairly standard allocation of a temporary tundevice
 // A variation of the code at http://www.kernel.org/doc/Documentation/networking/tuntap.txt
 
 // Return the fd of the new tun device
 // Sets dev to the actual device name
-int tun_alloc(char *dev, int devtype = IFF_TUN) 
+// With IFF_MULTI_QUEUE in flags, calling again with the same name
+// attaches another queue to the existing device.
+int tun_alloc(char *dev, int devtype = IFF_TUN, int flags = 0)
 {
   assert(dev != NULL);
   int fd = open("/dev/net/tun", O_RDWR);
@@ -54,208 +71,491 @@ int tun_alloc(char *dev, int devtype = IFF_TUN)
   struct ifreq ifr; 
   memset(&ifr, 0, sizeof(ifr)); 
   //ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
-  ifr.ifr_flags = devtype | IFF_NO_PI;
+  ifr.ifr_flags = devtype | IFF_NO_PI | flags;
   strncpy(ifr.ifr_name, dev, IFNAMSIZ); 
   CHECKSYS(ioctl(fd, TUNSETIFF, (void *) &ifr));
   strncpy(dev, ifr.ifr_name, IFNAMSIZ); 
   return fd;
 }
 
-static inline void put32(uint8_t *p, uint32_t n)
+// For a device opened with IFF_VNET_HDR, tell the kernel it can
+// send us packets with partial checksums and TCP segmentation still
+// to do.
+void tun_setoffload(int fd)
 {
-  memcpy(p,&n,sizeof(n));
+  unsigned offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+  CHECKSYS(ioctl(fd, TUNSETOFFLOAD, offloads));
 }
 
-static inline void put16(uint8_t *p, uint16_t n)
+// An existing interface, attached through an AF_PACKET socket with a
+// TPACKET_V3 receive ring: the kernel fills whole blocks of frames,
+// which we reflect in place and send straight back from the ring.
+#define PACKET_BLOCKSIZE (1 << 18)
+#define PACKET_NBLOCKS 32
+#define PACKET_FRAMESIZE 2048
+
+struct PacketRing
+{
+  uint8_t *map;
+  size_t blocksize;
+  int nblocks;
+};
+
+// Return a packet socket bound to ifname, with its receive ring
+// mapped. With fanout >= 0, the socket joins that fanout group, so
+// the interface's traffic is spread over the group by flow.
+int packet_alloc(const char *ifname, PacketRing *ring, int fanout)
 {
-  memcpy(p,&n,sizeof(n));
+  int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  CHECKFD(fd);
+  int version = TPACKET_V3;
+  CHECKSYS(setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)));
+
+  tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = PACKET_BLOCKSIZE;
+  req.tp_block_nr = PACKET_NBLOCKS;
+  req.tp_frame_size = PACKET_FRAMESIZE;
+  req.tp_frame_nr = (PACKET_BLOCKSIZE/PACKET_FRAMESIZE)*PACKET_NBLOCKS;
+  req.tp_retire_blk_tov = 1; // ms, so part filled blocks don't hang about
+  CHECKSYS(setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)));
+  size_t size = (size_t)PACKET_BLOCKSIZE*PACKET_NBLOCKS;
+  ring->map = (uint8_t *)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  CHECK(ring->map != MAP_FAILED);
+  ring->blocksize = PACKET_BLOCKSIZE;
+  ring->nblocks = PACKET_NBLOCKS;
+
+#if defined PACKET_IGNORE_OUTGOING
+  // We don't want to see our own replies. Needs Linux 4.20, so
+  // we check the packet type as well.
+  int one = 1;
+  setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+
+  int ifindex = if_nametoindex(ifname);
+  if (ifindex == 0) {
+    fprintf(stderr, "Unknown interface %s\n", ifname);
+    exit(0);
+  }
+  sockaddr_ll sll;
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+  CHECKSYS(bind(fd, (sockaddr *)&sll, sizeof(sll)));
+
+  // Our replies come from made up MAC addresses, so we need to
+  // see everything.
+  packet_mreq mreq;
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.mr_ifindex = ifindex;
+  mreq.mr_type = PACKET_MR_PROMISC;
+  CHECKSYS(setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)));
+
+  if (fanout >= 0) {
+    int arg = (fanout & 0xffff) | (PACKET_FANOUT_HASH << 16);
+    CHECKSYS(setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)));
+  }
+  return fd;
 }
 
-static inline void put8(uint8_t *p, uint8_t n)
+// Per-queue state. Each queue is served by its own thread with its
+// own buffer and counters (in the shared stats segment), so nothing
+// is shared in the packet loop.
+// Aligned to keep neighbouring queues off each other's cache lines.
+struct Queue
 {
-  *p = n;
+  int index;
+  int fd;
+  int devtype;
+  const char *dev;
+  pthread_t thread;
+  ThreadStats *stats;
+  PacketLog *log; // NULL if not logging
+  uint8_t *buf;
+  PacketRing ring; // For IO_PACKET
+  FlowTable *flows; // NULL if not tracking flows
+  int flowdumps; // Number of flow dumps done, see flowdump
+  bool pending; // For IO_EPOLL, on the worker's list of ready devices
+} __attribute__((aligned(64)));
+
+// Bumped by SIGUSR1: each queue prints its busiest flows when it
+// next sees a packet.
+volatile sig_atomic_t flowdump = 0;
+double ticksperus = 1;
+
+void onusr1(int)
+{
+  flowdump++;
 }
 
-static inline uint32_t get32(uint8_t *p)
+// The maximum number of queues the kernel allows (MAX_TAP_QUEUES)
+#define MAX_QUEUES 256
+
+// Pin the calling thread to the n'th cpu we are allowed to run on
+// (modulo the number of such cpus).
+void pincpu(int n)
 {
-  uint32_t n;
-  memcpy(&n,p,sizeof(n));
-  return n;
+  cpu_set_t allowed;
+  CHECKSYS(sched_getaffinity(0, sizeof(allowed), &allowed));
+  int ncpus = CPU_COUNT(&allowed);
+  n %= ncpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+      cpu_set_t cpuset;
+      CPU_ZERO(&cpuset);
+      CPU_SET(cpu, &cpuset);
+      CHECKSYS(pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset));
+      return;
+    }
+  }
 }
 
-static inline uint16_t get16(uint8_t *p)
+// Copy the start of a packet into the log ring, to be written out
+// once we know what happened to it.
+static inline PacketRecord *logpacket(Queue *q, uint8_t *p, size_t nbytes, bool gso)
 {
-  uint16_t n;
-  memcpy(&n,p,sizeof(n));
-  return n;
+  PacketRecord *record = pktlog_reserve(q->log);
+  if (record == NULL) {
+    statadd(&q->stats->logdropped,1);
+    return NULL;
+  }
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  record->time = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+  record->len = nbytes;
+  record->caplen = (nbytes < PKTLOG_SNAPLEN) ? nbytes : PKTLOG_SNAPLEN;
+  record->queue = q->index;
+  record->flags = gso ? PKTLOG_GSO : 0;
+  memcpy(record->data, p, record->caplen);
+  return record;
 }
 
-static inline uint8_t get8(uint8_t *p)
+// Count a packet and reflect it, returning true if it should be
+// written back.
+static inline bool process(Queue *q, uint8_t *p, size_t nbytes)
 {
-  return *p;
+  ThreadStats *stats = q->stats;
+  uint64_t start = statclock();
+  // The packet itself, after any virtio_net_hdr
+  uint8_t *pkt = p;
+  size_t pktlen = nbytes;
+  bool gso = false;
+  if (offload) {
+    if (nbytes < sizeof(virtio_net_hdr)) return false;
+    gso = get8(p+1) != VIRTIO_NET_HDR_GSO_NONE;
+    pkt += sizeof(virtio_net_hdr);
+    pktlen -= sizeof(virtio_net_hdr);
+  }
+  bool tap = q->devtype == IFF_TAP;
+  statadd(&stats->classes[classify(pkt,pktlen,tap)],1);
+  if (gso) statadd(&stats->gso,1);
+  // Flows are keyed on the packet as it arrives, before reflection
+  bool limited = false;
+  if (q->flows != NULL) {
+    FlowKey key;
+    uint8_t tcpflags;
+    if (flowkey(pkt,pktlen,tap,&key,&tcpflags)) {
+      limited = !q->flows->update(key,pktlen,tcpflags,start);
+    }
+    q->flows->age(start);
+    statset(&stats->flows,q->flows->nflows);
+    if (q->flowdumps != flowdump) {
+      q->flowdumps = flowdump;
+      flockfile(stdout);
+      printf("Queue %d: ", q->index);
+      q->flows->print(20,start,ticksperus);
+      funlockfile(stdout);
+      fflush(stdout);
+    }
+  }
+  PacketRecord *record = NULL;
+  if (q->log != NULL) record = logpacket(q,pkt,pktlen,gso);
+  bool respond;
+  if (limited) {
+    statadd(&stats->ratelimited,1);
+    respond = false;
+  } else if (offload) {
+    respond = reflectvnet(p,nbytes,q->dev,q->devtype);
+  } else if (tap) {
+    respond = reflecttap(p,nbytes,q->dev);
+  } else {
+    respond = reflect(p,nbytes,q->dev);
+  }
+  if (record != NULL) {
+    if (respond) record->flags |= PKTLOG_REFLECTED;
+    pktlog_commit(q->log);
+  }
+  statadd(&stats->packets,1);
+  statadd(&stats->bytes,nbytes);
+  statadd(respond ? &stats->reflected : &stats->dropped,1);
+  stattime(stats,statclock()-start);
+  return respond;
 }
 
-static void printbytes(uint8_t *p, size_t nbytes)
+void runsyscall(Queue *q)
 {
-  for (size_t i = 0; i < nbytes; i++) {
-    printf("%02x%s",
-	   p[i],
-	   ((i+1)%16 == 0 || i+1 == nbytes)?"\n":" ");
+  while(true) {
+    // Read a packet from fd, reflect addresses and write back to fd.
+    ssize_t nread = read(q->fd,q->buf,pktbufsize);
+    CHECK(nread >= 0);
+    if (nread == 0) break;
+    if (process(q,q->buf,nread)) {
+      ssize_t nwrite = write(q->fd,q->buf,nread);
+      CHECK(nwrite == nread);
+    }
   }
 }
 
-void swap(uint8_t *p, uint8_t *q, int nbytes)
+// Batched I/O through io_uring. We keep nbuffers reads outstanding
+// on a registered buffer area; as each completes we reflect the
+// packet in place and queue a write from the same buffer, and when
+// that completes the buffer goes back to reading. All the new
+// requests from one batch of completions go to the kernel in a single
+// io_uring_enter, which also waits for the next batch.
+// The user data for each request is the buffer index, with the
+// bottom bit set for writes.
+// Returns false if io_uring can't be set up.
+bool runuring(Queue *q)
 {
-  for (int i = 0; i < nbytes; i++) {
-    uint8_t t = *p; *p = *q; *q = t;
-    p++; q++;
+  // Keep the buffers cache line aligned
+  const size_t stride = (pktbufsize+63) & ~(size_t)63;
+  Uring ring;
+  int err = uring_init(&ring, nbuffers);
+  if (err < 0) {
+    fprintf(stderr, "Queue %d: io_uring unavailable: %s\n", q->index, strerror(-err));
+    return false;
+  }
+  size_t bufsize = nbuffers*stride;
+  uint8_t *bufs = (uint8_t *)mmap(NULL, bufsize, PROT_READ|PROT_WRITE,
+                                  MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+  CHECK(bufs != MAP_FAILED);
+  bool fixed = uring_registerbuffer(&ring, bufs, bufsize) == 0;
+  // Fixed operations use buffer index 0, which the cleared sqe already has
+  const uint8_t readop = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  const uint8_t writeop = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+
+  for (int i = 0; i < nbuffers; i++) {
+    io_uring_sqe *sqe = uring_getsqe(&ring);
+    CHECK(sqe != NULL);
+    uring_prep(sqe, readop, q->fd, bufs+i*stride, pktbufsize, (uint64_t)i << 1);
+  }
+  bool done = false;
+  while (!done) {
+    CHECK(uring_submit(&ring, 1) >= 0);
+    io_uring_cqe *cqe;
+    while ((cqe = uring_peekcqe(&ring)) != NULL) {
+      int index = cqe->user_data >> 1;
+      bool iswrite = cqe->user_data & 1;
+      int res = cqe->res;
+      uring_cqseen(&ring);
+      uint8_t *p = bufs+index*stride;
+      // Each buffer has exactly one request in flight, so there is
+      // always room in the submission queue.
+      io_uring_sqe *sqe = uring_getsqe(&ring);
+      CHECK(sqe != NULL);
+      if (!iswrite && res > 0 && process(q,p,res)) {
+        uring_prep(sqe, writeop, q->fd, p, res, ((uint64_t)index << 1) | 1);
+      } else {
+        if (iswrite) {
+          errno = -res;
+          CHECK(res >= 0);
+        } else if (res == 0) {
+          done = true;
+        } else if (res < 0 && res != -EAGAIN && res != -EINTR) {
+          errno = -res;
+          CHECK(res >= 0);
+        }
+        uring_prep(sqe, readop, q->fd, p, pktbufsize, (uint64_t)index << 1);
+      }
+    }
   }
+  // Tear down the ring first so any reads still in flight are cancelled
+  // before their buffers go away.
+  uring_exit(&ring);
+  munmap(bufs, bufsize);
+  return true;
 }
 
-// Rewrite packet to exchange src and dst addresses
-// Compare start and end states
-// Raise exceptions to indicate errors rather than exit()
-// Leave printing errors to caller.
-// Checks: p is non-null, nbytes is big enough for IP header
-// check on other fields - eg header length? 
-// Check IP checksum afterwards.
-// check no other bytes changed by function
-
-#define SRC_OFFSET4 12
-#define DST_OFFSET4 16
-#define SRC_OFFSET6 8
-#define DST_OFFSET6 24
-#define HLEN_OFFSET 0
-#define PROTO_OFFSET 9
-#define PROTO_ICMP 1
-#define PROTO_IGMP 2
-#define PROTO_TCP 6
-#define PROTO_UDP 17
-
-void describe4(uint8_t *p, size_t nbytes, const char *dev)
+// Frames from local senders (eg. over a veth) can arrive with the
+// transport checksum still to do, holding just the pseudo-header sum.
+static void finishframecsum(uint8_t *p, size_t nbytes)
 {
-   char fromaddr[INET_ADDRSTRLEN];
-   char toaddr[INET_ADDRSTRLEN];
-   int headerlen = 4*(p[HLEN_OFFSET]&0x0f);
-   int proto = p[PROTO_OFFSET];
-   inet_ntop(AF_INET, p+SRC_OFFSET4, fromaddr, sizeof(fromaddr));
-   inet_ntop(AF_INET, p+DST_OFFSET4, toaddr, sizeof(toaddr));
-   uint8_t *phdr = p+headerlen;
-   if (proto == PROTO_TCP) {
-      // Should do this for IPv6 as well
-      uint16_t srcport = ntohs(get16(phdr+0));
-      uint16_t dstport = ntohs(get16(phdr+2));
-      uint16_t flags = 0x0f & get8(phdr+13);
-      char flagstring[16];
-      snprintf(flagstring, sizeof(flagstring),
-               "%s%s%s%s",
-               (flags&1)?"F":"",
-               (flags&2)?"S":"", 
-               (flags&4)?"R":"",
-               (flags&8)?"P":"");
-      printf("dev=%s src=%s:%hu dst=%s:%hu len=%zu proto=%d flags=%s\n", 
-             dev, fromaddr, srcport, toaddr, dstport, nbytes, proto, flagstring);
-   } else if (proto == PROTO_UDP) {
-      uint16_t srcport = ntohs(get16(phdr+0));
-      uint16_t dstport = ntohs(get16(phdr+2));
-      printf("proto=4 dev=%s src=%s:%hu dst=%s:%hu len=%zu proto=%d\n",
-             dev, fromaddr, srcport, toaddr, dstport, nbytes, proto);
-   } else {
-      printf("proto=4 dev=%s src=%s dst=%s len=%zu proto=%d\n",
-             dev, fromaddr, toaddr, nbytes, proto);
-   }
+  if (nbytes < 14) return;
+  int etype = ntohs(get16(p+12));
+  if (etype == 0x0800 || etype == 0x86dd) finishcsum(p+14,nbytes-14);
 }
 
-void describe6(uint8_t *p, size_t nbytes, const char *dev)
+// Wait for each block of the ring in turn, reflect its frames in
+// place and send the replies back with a single sendmmsg, straight
+// from the ring, then hand the block back to the kernel.
+void runpacket(Queue *q)
 {
-  char fromaddr[INET6_ADDRSTRLEN];
-  char toaddr[INET6_ADDRSTRLEN];
-  inet_ntop(AF_INET6, p+SRC_OFFSET6, fromaddr, sizeof(fromaddr));
-  inet_ntop(AF_INET6, p+DST_OFFSET6, toaddr, sizeof(toaddr));
-  printf("proto=6 dev=%s src=%s dst=%s nbytes=%zu\n",
-         dev, fromaddr, toaddr, nbytes);
-  printbytes(p,40); // Just the header
+  PacketRing *ring = &q->ring;
+  // Every frame takes at least 64 bytes of the block
+  int maxframes = ring->blocksize/64;
+  mmsghdr *msgs = new mmsghdr[maxframes];
+  iovec *iovs = new iovec[maxframes];
+  memset(msgs, 0, maxframes*sizeof(*msgs));
+  for (int i = 0; i < maxframes; i++) {
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  for (int block = 0; ; block = (block+1) % ring->nblocks) {
+    tpacket_block_desc *desc = (tpacket_block_desc *)(ring->map + block*ring->blocksize);
+    while (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+      pollfd pfd = { q->fd, POLLIN|POLLERR, 0 };
+      CHECK(poll(&pfd, 1, -1) >= 0 || errno == EINTR);
+    }
+    int nframes = desc->hdr.bh1.num_pkts;
+    int nsend = 0;
+    uint8_t *frame = (uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt;
+    for (int i = 0; i < nframes; i++) {
+      tpacket3_hdr *hdr = (tpacket3_hdr *)frame;
+      sockaddr_ll *sll = (sockaddr_ll *)(frame + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+      uint8_t *p = frame + hdr->tp_mac;
+      size_t nbytes = hdr->tp_snaplen;
+      if (hdr->tp_status & TP_STATUS_CSUMNOTREADY) finishframecsum(p,nbytes);
+      if (sll->sll_pkttype != PACKET_OUTGOING && nbytes == hdr->tp_len &&
+          process(q,p,nbytes)) {
+        iovs[nsend].iov_base = p;
+        iovs[nsend].iov_len = nbytes;
+        nsend++;
+      }
+      frame += hdr->tp_next_offset;
+    }
+    for (int sent = 0; sent < nsend; ) {
+      int n = sendmmsg(q->fd, msgs+sent, nsend-sent, 0);
+      if (n < 0 && errno == EINTR) continue;
+      // Transmit queue full, just lose the rest
+      if (n < 0 && (errno == ENOBUFS || errno == EAGAIN)) break;
+      // Coalesced (GRO) frames can be too big to send back out, lose
+      // just that one.
+      if (n < 0 && errno == EMSGSIZE) { sent++; continue; }
+      CHECK(n > 0);
+      sent += n;
+    }
+    __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+  }
+  delete [] iovs;
+  delete [] msgs;
 }
 
-bool doarp(uint8_t *p, size_t nbytes, const char *dev)
+// With IO_EPOLL, each worker thread serves a set of devices (with a
+// single queue each) from its own epoll set.
+struct Worker
 {
-  (void)nbytes; (void)dev;
-  uint16_t op = ntohs(get16(p+14+6));
-  char fromaddr[INET_ADDRSTRLEN];
-  char toaddr[INET_ADDRSTRLEN];
-  // Skip 14 bytes of ethernet header
-  inet_ntop(AF_INET, p+14+14, fromaddr, sizeof(fromaddr));
-  inet_ntop(AF_INET, p+14+24, toaddr, sizeof(toaddr));
-  // Assume ethernet and IPv4
-  printf("proto=ARP op=%u src=%s dst=%s\n",
-         op, fromaddr, toaddr);
-  // Now construct the ARP response
-  put16(p+14+6,htons(2)); // Operation
-  uint8_t *mac = p+14+18;
-  mac[0] = 0x02; mac[1] = 0x00;
-  memcpy(mac+2,p+14+24,4); // Use expected IP as top 4 bytes of MAC
-  memcpy(p,mac,6); // Copy to source (it will be swapped later).
-  swap(p+14+8,p+14+18,10);
+  int index;
+  int epfd;
+  int nqueues;
+  Queue **queues;
+  pthread_t thread;
+};
+
+// Packets to take from a device before moving on to the next
+#define EPOLL_BATCH 64
+
+// Read and reflect up to a batch of packets from a non-blocking
+// device. Returns true if there may be more waiting.
+static bool drain(Queue *q)
+{
+  for (int i = 0; i < EPOLL_BATCH; i++) {
+    ssize_t nread = read(q->fd,q->buf,pktbufsize);
+    if (nread < 0 && (errno == EAGAIN || errno == EINTR)) return errno == EINTR;
+    CHECK(nread >= 0);
+    if (nread == 0) return false;
+    if (process(q,q->buf,nread)) {
+      ssize_t nwrite = write(q->fd,q->buf,nread);
+      // If the device can't take it, lose the packet rather than
+      // hold up the others.
+      CHECK(nwrite == nread || (nwrite < 0 && errno == EAGAIN));
+    }
+  }
   return true;
 }
 
-bool reflect(uint8_t *p, size_t nbytes, const char *dev)
+// Edge triggered, so we are only told when a device goes from empty
+// to having packets. A device still has packets if its last batch
+// didn't empty it, so it stays on the pending list (and we don't
+// block in epoll_wait) until it is drained; taking a batch from each
+// pending device in turn stops one busy device starving the others.
+void runepoll(Worker *w)
 {
-  uint8_t version = p[0] >> 4;
-  switch (version) {
-  case 4:
-    if (verbosity > 0) describe4(p,nbytes,dev);
-    if (verbosity > 1) printbytes(p, nbytes);
-    // Swap source and dest of an IPv4 packet
-    // No checksum recalculation is necessary
-    if (p[DST_OFFSET4] >= 224) { // BODGE: first byte of dest address - should use proper prefix
-      printf("Skipping %u.0.0.0\n", p[DST_OFFSET4]);
-      return false;
-    } else {
-      swap(p+SRC_OFFSET4,p+DST_OFFSET4,4);
-      return true;
+  epoll_event events[EPOLL_BATCH];
+  Queue **pending = new Queue*[w->nqueues];
+  int npending = 0;
+  while (true) {
+    int n = epoll_wait(w->epfd, events, EPOLL_BATCH, (npending > 0) ? 0 : -1);
+    if (n < 0 && errno == EINTR) continue;
+    CHECK(n >= 0);
+    for (int i = 0; i < n; i++) {
+      Queue *q = (Queue *)events[i].data.ptr;
+      if (!q->pending) {
+        q->pending = true;
+        pending[npending++] = q;
+      }
     }
-  case 6:
-    if (verbosity > 0) describe6(p,nbytes,dev);
-    if (verbosity > 1) printbytes(p, nbytes);
-    // Swap source and dest of an IPv6 packet
-    // No checksum recalculation is necessary
-    swap(p+SRC_OFFSET6,p+DST_OFFSET6,16);
-    return true;
-  default:
-    printf("Unknown protocol %u: nbytes=%zu\n",
-           version, nbytes);
-    return false;
+    int nleft = 0;
+    for (int i = 0; i < npending; i++) {
+      Queue *q = pending[i];
+      if (drain(q)) pending[nleft++] = q;
+      else q->pending = false;
+    }
+    npending = nleft;
   }
+  delete [] pending;
 }
 
-bool reflecttap(uint8_t *p, size_t nbytes, const char *dev)
+void *workerthread(void *arg)
 {
-  uint16_t etype;
-  memcpy(&etype,p+12,2);
-  etype = ntohs(etype);
-  printf("Frame etype=%04x nbytes=%zu\n", etype, nbytes);
-  printf("Addr1: "); printbytes(p,6);
-  printf("Addr2: "); printbytes(p+6,6);
-  bool respond = false;
-  if (etype == 0x0800 || etype == 0x86dd) {
-    // No CRC in TAP frames
-    respond = reflect(p+14,nbytes-14,dev);
-  } else if (etype == 0x0806) {
-    respond = doarp(p,nbytes,dev);
-  } else {
-    printbytes(p, nbytes);
+  Worker *w = (Worker *)arg;
+  pincpu(w->index);
+  runepoll(w);
+  return NULL;
+}
+
+void runqueue(Queue *q)
+{
+  if (ioengine == IO_PACKET) {
+    runpacket(q);
+  } else if (ioengine != IO_URING || !runuring(q)) {
+    runsyscall(q);
   }
-  if (respond) swap(p,p+6,6);
-  return respond;
+  if (verbosity > 0) {
+    printf("Queue %d: packets=%lu bytes=%lu reflected=%lu dropped=%lu gso=%lu logdropped=%lu\n",
+           q->index, q->stats->packets, q->stats->bytes, q->stats->reflected,
+           q->stats->dropped, q->stats->gso, q->stats->logdropped);
+  }
+}
+
+void *queuethread(void *arg)
+{
+  Queue *q = (Queue *)arg;
+  pincpu(q->index);
+  runqueue(q);
+  return NULL;
 }
 
 int main(int argc, char *argv[])
 {
   char *progname = argv[0];
-  char *devname = NULL;
-  const char *usage = "Usage: %s [--v] [--tap] <prefix> [<devname>]\n";
+  const char *usage =
+    "Usage: %s [--v] [--tap] [--queues N] [--io syscall|uring|epoll] [--buffers N]"
+    " [--offload] [--policy <file>] [--log <file>] [--logformat pcap|binary]"
+    " [--logsize N] [--packet <ifname>] [--flows N] [--flowtimeout S]"
+    " [--flowlimit PPS] [--flowburst N] [--rewrite <prefix>] [--verify]"
+    " [[tun:|tap:]<devname>...]\n";
   int devtype = IFF_TUN;
+  int nqueues = 1;
+  const char *policyfile = NULL;
+  const char *logfile = NULL;
+  LogFormat logformat = LOG_PCAP;
+  int logsize = 4096;
+  const char *packetif = NULL;
+  int maxflows = 0;
+  double flowtimeout = 60;
+  double flowlimit = 0;
+  int flowburst = 8;
   
   argc--; argv++;
   while (argc > 0 && argv[0][0] == '-') {
@@ -263,31 +563,162 @@ int main(int argc, char *argv[])
       verbosity++;
     } else if (strcmp(argv[0],"--tap") == 0) {
       devtype = IFF_TAP;
+    } else if (strcmp(argv[0],"--queues") == 0 && argc > 1) {
+      argc--; argv++;
+      nqueues = atoi(argv[0]);
+      if (nqueues < 1 || nqueues > MAX_QUEUES) {
+        fprintf(stderr, "%s: --queues must be between 1 and %d\n",
+                progname, MAX_QUEUES);
+        exit(0);
+      }
+    } else if (strcmp(argv[0],"--offload") == 0) {
+      offload = true;
+      pktbufsize = VNET_BUFSIZE;
+    } else if (strcmp(argv[0],"--policy") == 0 && argc > 1) {
+      argc--; argv++;
+      policyfile = argv[0];
+    } else if (strcmp(argv[0],"--log") == 0 && argc > 1) {
+      argc--; argv++;
+      logfile = argv[0];
+    } else if (strcmp(argv[0],"--logformat") == 0 && argc > 1) {
+      argc--; argv++;
+      if (strcmp(argv[0],"pcap") == 0) {
+        logformat = LOG_PCAP;
+      } else if (strcmp(argv[0],"binary") == 0) {
+        logformat = LOG_BINARY;
+      } else {
+        fprintf(stderr, usage, progname);
+        exit(0);
+      }
+    } else if (strcmp(argv[0],"--logsize") == 0 && argc > 1) {
+      argc--; argv++;
+      logsize = atoi(argv[0]);
+      if (logsize < 1 || logsize > 1<<20) {
+        fprintf(stderr, "%s: --logsize must be between 1 and %d\n", progname, 1<<20);
+        exit(0);
+      }
+    } else if (strcmp(argv[0],"--packet") == 0 && argc > 1) {
+      argc--; argv++;
+      packetif = argv[0];
+    } else if (strcmp(argv[0],"--flows") == 0 && argc > 1) {
+      argc--; argv++;
+      maxflows = atoi(argv[0]);
+      if (maxflows < 0 || maxflows > 1<<24) {
+        fprintf(stderr, "%s: --flows must be between 0 and %d\n", progname, 1<<24);
+        exit(0);
+      }
+    } else if (strcmp(argv[0],"--flowtimeout") == 0 && argc > 1) {
+      argc--; argv++;
+      flowtimeout = atof(argv[0]);
+    } else if (strcmp(argv[0],"--flowlimit") == 0 && argc > 1) {
+      argc--; argv++;
+      flowlimit = atof(argv[0]);
+    } else if (strcmp(argv[0],"--flowburst") == 0 && argc > 1) {
+      argc--; argv++;
+      flowburst = atoi(argv[0]);
+      if (flowburst < 1) {
+        fprintf(stderr, "%s: --flowburst must be at least 1\n", progname);
+        exit(0);
+      }
+    } else if (strcmp(argv[0],"--rewrite") == 0 && argc > 1) {
+      argc--; argv++;
+      if (!setrewrite(argv[0])) {
+        fprintf(stderr, "%s: bad --rewrite prefix %s\n", progname, argv[0]);
+        exit(0);
+      }
+    } else if (strcmp(argv[0],"--verify") == 0) {
+      verifycsum = true;
+    } else if (strcmp(argv[0],"--io") == 0 && argc > 1) {
+      argc--; argv++;
+      if (strcmp(argv[0],"syscall") == 0) {
+        ioengine = IO_SYSCALL;
+      } else if (strcmp(argv[0],"uring") == 0) {
+        ioengine = IO_URING;
+      } else if (strcmp(argv[0],"epoll") == 0) {
+        ioengine = IO_EPOLL;
+      } else {
+        fprintf(stderr, usage, progname);
+        exit(0);
+      }
+    } else if (strcmp(argv[0],"--buffers") == 0 && argc > 1) {
+      argc--; argv++;
+      nbuffers = atoi(argv[0]);
+      if (nbuffers < 1 || nbuffers > 4096) {
+        fprintf(stderr, "%s: --buffers must be between 1 and 4096\n", progname);
+        exit(0);
+      }
     } else {
       fprintf(stderr, usage, progname);
       exit(0);
     }
     argc--; argv++;
   }
-  if (argc > 1) {
+  // The devices, each optionally marked as tun or tap (otherwise as
+  // given by --tap). With more than one, they are all served by epoll.
+  int ndevs = (argc > 0) ? argc : 1;
+  char (*devs)[IFNAMSIZ+1] = new char[ndevs][IFNAMSIZ+1];
+  int *devtypes = new int[ndevs];
+  for (int i = 0; i < ndevs; i++) {
+    const char *name = (argc > 0) ? argv[i] : "";
+    devtypes[i] = devtype;
+    if (strncmp(name,"tun:",4) == 0) {
+      devtypes[i] = IFF_TUN;
+      name += 4;
+    } else if (strncmp(name,"tap:",4) == 0) {
+      devtypes[i] = IFF_TAP;
+      name += 4;
+    }
+    memset(devs[i],0,sizeof(devs[i]));
+    strncpy(devs[i],name,sizeof(devs[i])-1);
+  }
+  if (ndevs > 1) {
+    if (ioengine != IO_SYSCALL && ioengine != IO_EPOLL) {
+      fprintf(stderr, "%s: several devices need --io epoll\n", progname);
+      exit(0);
+    }
+    ioengine = IO_EPOLL;
+  }
+  if (packetif != NULL) {
+    // Existing interfaces are always ethernet, and we don't do offload
+    if (argc > 0 || offload || ioengine != IO_SYSCALL) {
       fprintf(stderr, usage, progname);
       exit(0);
+    }
+    strncpy(devs[0],packetif,sizeof(devs[0])-1);
+    devtypes[0] = IFF_TAP;
+    ioengine = IO_PACKET;
   }
-  if (argc > 0) devname = argv[1];
+  // With epoll, each device has one queue and --queues is the number
+  // of worker threads serving them.
+  int nworkers = 0;
+  if (ioengine == IO_EPOLL) {
+    nworkers = (nqueues < ndevs) ? nqueues : ndevs;
+    nqueues = ndevs;
+  }
+  // The pcap header has one link type for all the packets
+  if (logfile != NULL && logformat == LOG_PCAP) {
+    for (int i = 1; i < ndevs; i++) {
+      if (devtypes[i] != devtypes[0]) {
+        fprintf(stderr, "%s: can't log tun and tap devices to one pcap file\n", progname);
+        exit(0);
+      }
+    }
+  }
+  // Rate limiting needs the flow table
+  if (flowlimit > 0 && maxflows == 0) maxflows = 4096;
 
-  char dev[IFNAMSIZ+1];
-  memset(dev,0,sizeof(dev));
-  if (devname != NULL) strncpy(dev,devname,sizeof(dev)-1);
+  loadpolicy(policyfile);
 
 #if defined USE_CAPABILITIES
   cap_t caps = cap_get_proc();
   CHECK(caps != NULL);
 
-  cap_value_t cap = CAP_NET_ADMIN;
-  const char *capname = STRING(CAP_NET_ADMIN);
+  // Packet sockets need CAP_NET_RAW rather than CAP_NET_ADMIN
+  cap_value_t cap = (packetif != NULL) ? CAP_NET_RAW : CAP_NET_ADMIN;
+  const char *capname = (packetif != NULL) ? STRING(CAP_NET_RAW) : STRING(CAP_NET_ADMIN);
 
   // Check that we have the required capabilities
-  // At this point we only require CAP_NET_ADMIN to be permitted,
+  // At this point we only require the capability to be permitted,
   // not effective as we will be enabling it later.
   cap_flag_value_t cap_permitted;
   CHECKSYS(cap_get_flag(caps, cap, CAP_PERMITTED, &cap_permitted));
@@ -313,9 +744,51 @@ int main(int argc, char *argv[])
   CHECKSYS(cap_set_proc(caps));
 #endif
 
-  // Allocate the tun device
-  int fd = tun_alloc(dev,devtype);
-  if (fd < 0) exit(0);
+  // Allocate the tun devices (or attach to the interface), with a fd
+  // for each queue. With epoll, queue i is device i, otherwise all
+  // the queues are on the one device.
+  Queue *queues = new Queue[nqueues];
+  for (int i = 0; i < nqueues; i++) {
+    Queue *q = &queues[i];
+    memset(q,0,sizeof(*q));
+    q->index = i;
+    int d = (ioengine == IO_EPOLL) ? i : 0;
+    if (packetif != NULL) {
+      q->fd = packet_alloc(packetif, &q->ring, (nqueues > 1) ? getpid() : -1);
+    } else {
+      int flags = 0;
+      if (ioengine != IO_EPOLL && nqueues > 1) flags |= IFF_MULTI_QUEUE;
+      if (offload) flags |= IFF_VNET_HDR;
+      q->fd = tun_alloc(devs[d],devtypes[d],flags);
+      if (q->fd < 0) exit(0);
+      if (offload) tun_setoffload(q->fd);
+    }
+    if (ioengine == IO_EPOLL) {
+      int fl = fcntl(q->fd, F_GETFL);
+      CHECK(fl >= 0);
+      CHECKSYS(fcntl(q->fd, F_SETFL, fl | O_NONBLOCK));
+    }
+    q->buf = (uint8_t *)malloc(pktbufsize);
+    CHECK(q->buf != NULL);
+    q->devtype = devtypes[d];
+    q->dev = devs[d];
+  }
+
+  // With several devices, the statistics are named after the first,
+  // with a "thread" for each device.
+  StatsSegment *stats = createstats(devs[0], nqueues);
+  for (int i = 0; i < nqueues; i++) queues[i].stats = &stats->threads[i];
+
+  // Flow tables are per queue (the kernel keeps a flow on one queue)
+  if (maxflows > 0) {
+    ticksperus = stats->ticksperus;
+    uint64_t timeout = flowtimeout*1e6*ticksperus;
+    uint64_t interval = (flowlimit > 0) ? 1e6*ticksperus/flowlimit : 0;
+    for (int i = 0; i < nqueues; i++) {
+      queues[i].flows = new FlowTable(maxflows,timeout,interval,flowburst);
+    }
+    signal(SIGUSR1,onusr1);
+  }
 
 #if defined USE_CAPABILITIES
   // And before anything else, clear all our capabilities
@@ -325,24 +798,86 @@ int main(int argc, char *argv[])
 #endif
 
   if (verbosity > 0) {
-    printf("Created tun device %s\n", dev);
+    if (ioengine == IO_EPOLL) {
+      for (int i = 0; i < ndevs; i++) {
+        printf("Created %s device %s\n", (devtypes[i] == IFF_TAP) ? "tap" : "tun", devs[i]);
+      }
+      printf("Serving %d device%s with %d thread%s\n",
+             ndevs, (ndevs > 1) ? "s" : "", nworkers, (nworkers > 1) ? "s" : "");
+    } else {
+      printf("%s %s with %d queue%s\n",
+             (packetif != NULL) ? "Attached to interface" : "Created tun device",
+             devs[0], nqueues, (nqueues > 1) ? "s" : "");
+    }
   }
 
-  uint8_t buf[2048];
-  while(true) {
-    // Read a packet from fd, reflect addresses and write back to fd.
-    ssize_t nread = read(fd,buf,sizeof(buf));
-    CHECK(nread >= 0);
-    if (nread == 0) break;
-    bool respond;
-    if (devtype == IFF_TUN) {
-      respond = reflect(buf,nread,dev);
+  // Packets are described (with --v) or logged from a separate thread
+  Logger *logger = NULL;
+  if (logfile != NULL) {
+    logger = startlogger(nqueues, logsize, logformat, logfile, devs[0], devtypes[0] == IFF_TAP);
+  } else if (verbosity > 0) {
+    logger = startlogger(nqueues, logsize, LOG_TEXT, NULL, devs[0], devtypes[0] == IFF_TAP);
+  }
+  if (logger != NULL) {
+    for (int i = 0; i < nqueues; i++) {
+      queues[i].log = &logger->logs[i];
+      queues[i].log->dev = queues[i].dev;
+      queues[i].log->tap = queues[i].devtype == IFF_TAP;
+    }
+  }
+
+  if (ioengine == IO_EPOLL) {
+    // Device i goes to worker i % nworkers
+    Worker *workers = new Worker[nworkers];
+    for (int i = 0; i < nworkers; i++) {
+      Worker *w = &workers[i];
+      w->index = i;
+      w->epfd = epoll_create1(0);
+      CHECKFD(w->epfd);
+      w->nqueues = 0;
+      w->queues = new Queue*[(nqueues+nworkers-1)/nworkers];
+    }
+    for (int i = 0; i < nqueues; i++) {
+      Worker *w = &workers[i % nworkers];
+      epoll_event event;
+      memset(&event,0,sizeof(event));
+      event.events = EPOLLIN | EPOLLET;
+      event.data.ptr = &queues[i];
+      CHECKSYS(epoll_ctl(w->epfd, EPOLL_CTL_ADD, queues[i].fd, &event));
+      w->queues[w->nqueues++] = &queues[i];
+    }
+    if (nworkers == 1) {
+      runepoll(&workers[0]);
     } else {
-      respond = reflecttap(buf,nread,dev);
+      for (int i = 0; i < nworkers; i++) {
+        CHECKSYS(pthread_create(&workers[i].thread, NULL, workerthread, &workers[i]));
+      }
+      for (int i = 0; i < nworkers; i++) {
+        CHECKSYS(pthread_join(workers[i].thread, NULL));
+      }
     }
-    if (respond) {
-      ssize_t nwrite = write(fd,buf,nread);
-      CHECK(nwrite == nread);
+    for (int i = 0; i < nworkers; i++) {
+      close(workers[i].epfd);
+      delete [] workers[i].queues;
+    }
+    delete [] workers;
+  } else if (nqueues == 1) {
+    // No need for extra threads, just run in the main thread
+    runqueue(&queues[0]);
+  } else {
+    for (int i = 0; i < nqueues; i++) {
+      CHECKSYS(pthread_create(&queues[i].thread, NULL, queuethread, &queues[i]));
     }
+    for (int i = 0; i < nqueues; i++) {
+      CHECKSYS(pthread_join(queues[i].thread, NULL));
+    }
+  }
+  if (logger != NULL) stoplogger(logger);
+  for (int i = 0; i < nqueues; i++) {
+    free(queues[i].buf);
+    delete queues[i].flows;
   }
+  delete [] queues;
+  delete [] devs;
+  delete [] devtypes;
 }
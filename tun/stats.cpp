@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+void statsname(char *name, size_t size, const char *dev)
+{
+  snprintf(name, size, "/reflect.%s", dev);
+}
+
+static size_t statssize(int nthreads)
+{
+  return sizeof(StatsSegment) + nthreads*sizeof(ThreadStats);
+}
+
+// Measure the statclock rate against the real time clock
+static double calibrate()
+{
+  timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  uint64_t ticks0 = statclock();
+  timespec delay = { 0, 20000000 };
+  nanosleep(&delay, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  uint64_t ticks1 = statclock();
+  double us = (t1.tv_sec-t0.tv_sec)*1e6 + (t1.tv_nsec-t0.tv_nsec)/1e3;
+  return (ticks1-ticks0)/us;
+}
+
+StatsSegment *createstats(const char *dev, int nthreads)
+{
+  char name[64];
+  statsname(name, sizeof(name), dev);
+  size_t size = statssize(nthreads);
+  void *mem = MAP_FAILED;
+  // Start with a new object, anyone watching an old one keeps it
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+  if (fd >= 0) {
+    CHECKSYS(ftruncate(fd, size));
+    mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    CHECKSYS(close(fd));
+  }
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "Can't create shared memory %s: %s\n", name, strerror(errno));
+    mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    CHECK(mem != MAP_FAILED);
+  }
+  StatsSegment *seg = (StatsSegment *)mem;
+  memset(seg, 0, size);
+  seg->version = STATS_VERSION;
+  seg->nthreads = nthreads;
+  seg->pid = getpid();
+  strncpy(seg->dev, dev, sizeof(seg->dev)-1);
+  seg->ticksperus = calibrate();
+  // Readers check the magic number last
+  __atomic_store_n(&seg->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+  return seg;
+}
+
+const StatsSegment *openstats(const char *dev)
+{
+  char name[64];
+  statsname(name, sizeof(name), dev);
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) return NULL;
+  struct stat st;
+  CHECKSYS(fstat(fd, &st));
+  void *mem = MAP_FAILED;
+  if ((size_t)st.st_size >= sizeof(StatsSegment)) {
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  CHECKSYS(close(fd));
+  if (mem == MAP_FAILED) return NULL;
+  const StatsSegment *seg = (const StatsSegment *)mem;
+  if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+      seg->version != STATS_VERSION ||
+      (size_t)st.st_size < statssize(seg->nthreads)) {
+    munmap(mem, st.st_size);
+    return NULL;
+  }
+  return seg;
+}
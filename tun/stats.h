@@ -0,0 +1,100 @@
+// Packet statistics for reflect, published in shared memory so that
+// reflect-stat can watch them live.
+//
+// Each thread has its own cache line aligned block of counters that
+// only it writes, so there is no locking or sharing in the packet
+// loop. Counters are updated with relaxed atomic stores so a reader
+// never sees a torn value; a reader may see counters from slightly
+// different moments, which doesn't matter for monitoring.
+
+#if !defined STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <linux/if.h>
+
+#if defined __x86_64__ || defined __i386__
+#include <x86intrin.h>
+#endif
+
+#include "packet.h"
+
+#define STATS_MAGIC 0x74617473666c6572ULL // "reflstat"
+#define STATS_VERSION 3
+// Processing time buckets: bucket i counts packets taking less than
+// 2^i clock ticks (see ticksperus), the last bucket is everything else.
+#define STATS_NBUCKETS 24
+
+struct ThreadStats
+{
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t reflected;
+  uint64_t dropped;
+  uint64_t gso;
+  uint64_t logdropped; // Packet log records lost to a full ring
+  uint64_t ratelimited; // Dropped for being over the flow rate limit
+  uint64_t flows; // Flows in the flow table now (not a counter)
+  uint64_t classes[NCLASSES];
+  uint64_t ticks[STATS_NBUCKETS];
+} __attribute__((aligned(64)));
+
+struct StatsSegment
+{
+  uint64_t magic;
+  uint32_t version;
+  uint32_t nthreads;
+  pid_t pid;
+  char dev[IFNAMSIZ];
+  double ticksperus; // For converting processing times
+  ThreadStats threads[];
+} __attribute__((aligned(64)));
+
+// A cheap clock for timing packets: the TSC where we have one,
+// otherwise nanoseconds.
+static inline uint64_t statclock()
+{
+#if defined __x86_64__ || defined __i386__
+  return __rdtsc();
+#else
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Only the owning thread writes a counter, so this needn't be an
+// atomic read-modify-write, just a store that can't be torn.
+static inline void statadd(uint64_t *counter, uint64_t n)
+{
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void stattime(ThreadStats *stats, uint64_t ticks)
+{
+  int bucket = (ticks == 0) ? 0 : 64 - __builtin_clzll(ticks);
+  if (bucket >= STATS_NBUCKETS) bucket = STATS_NBUCKETS-1;
+  statadd(&stats->ticks[bucket], 1);
+}
+
+static inline void statset(uint64_t *counter, uint64_t n)
+{
+  __atomic_store_n(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t statread(const uint64_t *counter)
+{
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// The shared memory object name for a device
+void statsname(char *name, size_t size, const char *dev);
+// Create the segment for a device, or just allocate some memory if
+// shared memory isn't available, so the counters are always there.
+StatsSegment *createstats(const char *dev, int nthreads);
+// Map an existing segment read only, or return NULL.
+const StatsSegment *openstats(const char *dev);
+
+#endif
@@ -0,0 +1,168 @@
+// A minimal io_uring wrapper, just enough for batched packet I/O,
+// using the raw system calls so we don't need liburing.
+// See https://kernel.dk/io_uring.pdf for the details.
+
+#if !defined URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct Uring
+{
+  int fd;
+  // Submission queue
+  unsigned *sqhead;
+  unsigned *sqtail;
+  unsigned sqmask;
+  unsigned *sqarray;
+  io_uring_sqe *sqes;
+  unsigned sqpending; // Entries queued but not yet submitted
+  // Completion queue
+  unsigned *cqhead;
+  unsigned *cqtail;
+  unsigned cqmask;
+  io_uring_cqe *cqes;
+  // Mappings, for cleanup
+  void *sqring;
+  size_t sqringsize;
+  void *cqring;
+  size_t cqringsize;
+  size_t sqessize;
+};
+
+static inline int uring_setup(unsigned entries, io_uring_params *params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int uring_enter(int fd, unsigned tosubmit, unsigned minwait, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, tosubmit, minwait, flags, NULL, 0);
+}
+
+static inline int uring_register(int fd, unsigned opcode, void *arg, unsigned nargs)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+// Set up a ring with (at least) the given number of submission entries.
+// Returns 0 on success or -errno (eg. if io_uring isn't available,
+// so the caller can fall back to plain system calls).
+static inline int uring_init(Uring *ring, unsigned entries)
+{
+  memset(ring, 0, sizeof(*ring));
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = uring_setup(entries, &params);
+  if (fd < 0) return -errno;
+  ring->fd = fd;
+
+  ring->sqringsize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+  ring->cqringsize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+  ring->sqessize = params.sq_entries*sizeof(io_uring_sqe);
+  ring->sqring = mmap(NULL, ring->sqringsize, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cqring = mmap(NULL, ring->cqringsize, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void *sqes = mmap(NULL, ring->sqessize, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqring == MAP_FAILED || ring->cqring == MAP_FAILED || sqes == MAP_FAILED) {
+    int err = errno;
+    close(fd);
+    return -err;
+  }
+  uint8_t *sq = (uint8_t *)ring->sqring;
+  ring->sqhead = (unsigned *)(sq + params.sq_off.head);
+  ring->sqtail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sqmask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sqarray = (unsigned *)(sq + params.sq_off.array);
+  ring->sqes = (io_uring_sqe *)sqes;
+  uint8_t *cq = (uint8_t *)ring->cqring;
+  ring->cqhead = (unsigned *)(cq + params.cq_off.head);
+  ring->cqtail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cqmask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+}
+
+static inline void uring_exit(Uring *ring)
+{
+  munmap(ring->sqes, ring->sqessize);
+  munmap(ring->cqring, ring->cqringsize);
+  munmap(ring->sqring, ring->sqringsize);
+  close(ring->fd);
+}
+
+// Get the next free submission entry, or NULL if the ring is full.
+// The entry is cleared, but not made visible to the kernel until
+// the next uring_submit.
+static inline io_uring_sqe *uring_getsqe(Uring *ring)
+{
+  unsigned head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sqtail + ring->sqpending;
+  if (tail - head > ring->sqmask) return NULL;
+  unsigned index = tail & ring->sqmask;
+  io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sqarray[index] = index;
+  ring->sqpending++;
+  return sqe;
+}
+
+static inline void uring_prep(io_uring_sqe *sqe, uint8_t opcode, int fd,
+                              void *addr, unsigned len, uint64_t userdata)
+{
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)addr;
+  sqe->len = len;
+  sqe->off = (uint64_t)-1; // Use (and ignore) the file position
+  sqe->user_data = userdata;
+}
+
+// Submit everything queued since the last call and wait for at
+// least minwait completions, all in one system call.
+static inline int uring_submit(Uring *ring, unsigned minwait)
+{
+  unsigned tosubmit = ring->sqpending;
+  __atomic_store_n(ring->sqtail, *ring->sqtail + tosubmit, __ATOMIC_RELEASE);
+  ring->sqpending = 0;
+  while (true) {
+    int ret = uring_enter(ring->fd, tosubmit, minwait,
+                          minwait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (ret >= 0 || errno != EINTR) return ret;
+  }
+}
+
+// Return the next completion entry, or NULL if there are none.
+static inline io_uring_cqe *uring_peekcqe(Uring *ring)
+{
+  unsigned head = *ring->cqhead;
+  unsigned tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+  if (head == tail) return NULL;
+  return &ring->cqes[head & ring->cqmask];
+}
+
+// Finished with the entry returned by uring_peekcqe
+static inline void uring_cqseen(Uring *ring)
+{
+  __atomic_store_n(ring->cqhead, *ring->cqhead + 1, __ATOMIC_RELEASE);
+}
+
+// Register a single buffer for use with the _FIXED operations
+// (buffer index 0). Returns 0 or -errno.
+static inline int uring_registerbuffer(Uring *ring, void *buf, size_t size)
+{
+  iovec iov = { buf, size };
+  if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) return -errno;
+  return 0;
+}
+
+#endif